@@ -3,6 +3,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 /*
    Create a bitmap structure
@@ -14,6 +15,13 @@ BITMAP4* Create_Bitmap(int nx, int ny) { return ((BITMAP4*)malloc(nx * ny * size
 */
 void Destroy_Bitmap(BITMAP4* bm) { free(bm); }
 
+/*
+   As Create_Bitmap() and Destroy_Bitmap() for RGB bitmaps, 3 bytes per pixel
+*/
+BITMAP3* Create_Bitmap3(int nx, int ny) { return ((BITMAP3*)malloc((size_t)nx * ny * sizeof(BITMAP3))); }
+
+void Destroy_Bitmap3(BITMAP3* bm) { free(bm); }
+
 /*
    Compare two pixels
 */
@@ -442,6 +450,10 @@ void BM_WriteHexString(FILE* fptr, char* s) {
 /*
    Clear the bitmap to a particular colour
 */
+void Erase_Bitmap3(BITMAP3* bm, int nx, int ny, BITMAP3 col) {
+    for(long index = 0; index < (long)nx * ny; index++) bm[index] = col;
+}
+
 void Erase_Bitmap(BITMAP4* bm, int nx, int ny, BITMAP4 col) {
     int i, j;
     long index;
@@ -1397,6 +1409,205 @@ int Read_UInt(FILE* fptr, unsigned int* n, int swap) {
     return (TRUE);
 }
 
+/*
+   Big endian integer of n bytes, -1 at end of file
+*/
+long BM_ReadBigEndian(FILE* fptr, int n) {
+    long value = 0;
+    int c;
+
+    for(int i = 0; i < n; i++) {
+        if((c = getc(fptr)) == EOF) return (-1);
+        value = (value << 8) | c;
+    }
+    return (value);
+}
+
+/*
+   Create a codec context, to be passed to the *Codec() read and write functions
+   The libjpeg objects, buffers and row pointers are kept and reused from one image to the next
+*/
+CODEC* Create_Codec(void) {
+    CODEC* codec;
+
+    if((codec = calloc(1, sizeof(CODEC))) == NULL) return (NULL);
+#ifdef ADDPNG
+    codec->pnglevel = Z_DEFAULT_COMPRESSION;
+    codec->pngfilter = -1;
+#endif
+
+    return (codec);
+}
+
+void Destroy_Codec(CODEC* codec) {
+    if(codec == NULL) return;
+#ifdef ADDPNG
+    for(int n = 0; n < codec->nbands; n++) {
+        if(codec->bands[n].hasstrm) deflateEnd(&codec->bands[n].strm);
+        free(codec->bands[n].out);
+        free(codec->bands[n].work);
+    }
+    free(codec->bands);
+#endif
+#ifdef ADDJPEG
+    if(codec->hasdecompress) jpeg_destroy_decompress(&codec->dinfo);
+    if(codec->hascompress) jpeg_destroy_compress(&codec->cinfo);
+#endif
+#ifdef ADDTURBOJPEG
+    if(codec->tjdecompress != NULL) tjDestroy(codec->tjdecompress);
+    if(codec->tjcompress != NULL) tjDestroy(codec->tjcompress);
+#endif
+    free(codec->row);
+    free(codec->rows);
+    free(codec);
+}
+
+/*
+   malloc() that keeps count of allocations and the time spent in them
+*/
+void* Codec_Malloc(CODEC* codec, size_t size) {
+    struct timespec t0, t1;
+    void* p;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    p = malloc(size);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    codec->nalloc++;
+    codec->allocbytes += size;
+    codec->alloctime += (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9;
+
+    return (p);
+}
+
+/*
+   Scanline buffer of at least size bytes, only reallocated when it needs to grow
+*/
+unsigned char* Codec_Row(CODEC* codec, size_t size) {
+    if(size > codec->rowsize) {
+        free(codec->row);
+        if((codec->row = Codec_Malloc(codec, size)) == NULL) {
+            codec->rowsize = 0;
+            return (NULL);
+        }
+        codec->rowsize = size;
+    }
+    return (codec->row);
+}
+
+/*
+   Array of at least n row pointers, only reallocated when it needs to grow
+*/
+void** Codec_Rows(CODEC* codec, int n) {
+    if(n > codec->nrows) {
+        free(codec->rows);
+        if((codec->rows = Codec_Malloc(codec, n * sizeof(void*))) == NULL) {
+            codec->nrows = 0;
+            return (NULL);
+        }
+        codec->nrows = n;
+    }
+    return (codec->rows);
+}
+
+/*
+   Determine the image format from the magic bytes at the start of the file
+   Return JPG or PNG, -1 if neither, the file is rewound
+*/
+int Detect_Format(FILE* fptr) {
+    unsigned char magic[8];
+    size_t n;
+
+    n = fread(magic, 1, 8, fptr);
+    rewind(fptr);
+
+    return (Detect_FormatMem(magic, n));
+}
+
+/*
+   As Detect_Format() for an image already read into memory
+*/
+int Detect_FormatMem(const unsigned char* data, size_t size) {
+    static const unsigned char pngmagic[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+
+    if(size < 8) return (-1);
+    if(data[0] == 0xff && data[1] == 0xd8 && data[2] == 0xff) return (JPG);
+    if(memcmp(data, pngmagic, 8) == 0) return (PNG);
+
+    return (-1);
+}
+
+/*
+   Read only the header of a JPEG or PNG image, the JPEG start of frame or PNG IHDR chunk
+   Nothing is decoded, so this is cheap enough to call for every file
+   Return the format as Detect_Format(), -1 if not recognised or the header is damaged
+   The file is rewound
+*/
+int Probe_Image(FILE* fptr, IMAGEINFO* info) {
+    int format, marker;
+    long length;
+
+    info->width = -1;
+    info->height = -1;
+    info->components = 0;
+    info->bitdepth = 0;
+    if((format = Detect_Format(fptr)) < 0) return (-1);
+
+    if(format == PNG) {
+        // Signature, then the IHDR chunk is always first
+        fseek(fptr, 8, SEEK_SET);
+        length = BM_ReadBigEndian(fptr, 4);
+        if(length < 13 || BM_ReadBigEndian(fptr, 4) != 0x49484452) format = -1; // "IHDR"
+        else {
+            info->width = BM_ReadBigEndian(fptr, 4);
+            info->height = BM_ReadBigEndian(fptr, 4);
+            info->bitdepth = getc(fptr);
+            switch(getc(fptr)) {
+            case 0: info->components = 1; break; // Grey
+            case 2: info->components = 3; break; // RGB
+            case 3: info->components = 1; break; // Palette
+            case 4: info->components = 2; break; // Grey and alpha
+            case 6: info->components = 4; break; // RGBA
+            default: format = -1; break;
+            }
+        }
+    } else {
+        // Walk the markers after SOI up to the first start of frame
+        fseek(fptr, 2, SEEK_SET);
+        for(;;) {
+            if(getc(fptr) != 0xff) {
+                format = -1;
+                break;
+            }
+            while((marker = getc(fptr)) == 0xff)
+                ; // Fill bytes
+            if(marker == EOF || marker == 0xd9 || marker == 0xda) { // End of file, image or start of scan first
+                format = -1;
+                break;
+            }
+            if(marker == 0x01 || (marker >= 0xd0 && marker <= 0xd7)) continue; // No length
+            if((length = BM_ReadBigEndian(fptr, 2)) < 2) {
+                format = -1;
+                break;
+            }
+            if(marker >= 0xc0 && marker <= 0xcf && marker != 0xc4 && marker != 0xc8 && marker != 0xcc) {
+                info->bitdepth = getc(fptr);
+                info->height = BM_ReadBigEndian(fptr, 2);
+                info->width = BM_ReadBigEndian(fptr, 2);
+                info->components = getc(fptr);
+                break;
+            }
+            if(fseek(fptr, length - 2, SEEK_CUR) != 0) {
+                format = -1;
+                break;
+            }
+        }
+    }
+    if(info->width <= 0 || info->height <= 0 || info->components <= 0 || info->bitdepth <= 0) format = -1;
+    rewind(fptr);
+
+    return (format);
+}
+
 #ifdef ADDJPEG
 boolean IsJPEG(const char* fname) {
     char s[256];
@@ -1419,150 +1630,307 @@ boolean IsJPEG(const char* fname) {
    Negative means flip vertically
 */
 int JPEG_Write(FILE* fptr, BITMAP4* image, int width, int height, int quality) {
-    int index;
-    int i, j, flip = FALSE;
-    struct jpeg_compress_struct cinfo;
+    CODEC* codec;
+    int status;
+
+    if((codec = Create_Codec()) == NULL) return (1);
+    status = JPEG_WriteCodec(codec, fptr, image, width, height, quality);
+    Destroy_Codec(codec);
+
+    return (status);
+}
+
+/*
+   As JPEG_Write() reusing the compressor of a codec, codec->fullchroma selects 4:4:4 rather than 4:2:0
+*/
+int JPEG_WriteCodec(CODEC* codec, FILE* fptr, const BITMAP4* image, int width, int height, int quality) {
+    return (JPEG_WritePixels(codec, fptr, (const unsigned char*)image, 4, width, height, quality));
+}
+
+/*
+   As JPEG_WriteCodec() for an RGB bitmap
+*/
+int JPEG_WriteCodec3(CODEC* codec, FILE* fptr, const BITMAP3* image, int width, int height, int quality) {
+    return (JPEG_WritePixels(codec, fptr, (const unsigned char*)image, 3, width, height, quality));
+}
+
+#ifdef ADDTURBOJPEG
+/*
+   Write RGB or RGBX pixels, components 3 or 4, with the TurboJPEG API, the pixels are compressed
+   as they are, in the order the rows are stored, into the codec buffer which is then written out in one go
+   Same settings as libjpeg's defaults, 4:2:0 chroma subsampling unless codec->fullchroma
+*/
+int JPEG_WritePixels(CODEC* codec, FILE* fptr, const unsigned char* pixels, int components, int width, int height, int quality) {
+    int flags = TJFLAG_NOREALLOC;
+    int subsamp = codec->fullchroma ? TJSAMP_444 : TJSAMP_420;
+    unsigned long size = tjBufSize(width, height, subsamp);
+    unsigned char* buffer;
+
+    if(quality > 0) // Historical, rows stored bottom up
+        flags |= TJFLAG_BOTTOMUP;
+    quality = ABS(quality);
+
+    if(codec->tjcompress == NULL && (codec->tjcompress = tjInitCompress()) == NULL) return (FALSE);
+    if((buffer = Codec_Row(codec, size)) == NULL) return (FALSE);
+
+    if(tjCompress2(codec->tjcompress,
+                   pixels,
+                   width,
+                   0,
+                   height,
+                   (components == 3) ? TJPF_RGB : TJPF_RGBX,
+                   &buffer,
+                   &size,
+                   subsamp,
+                   quality,
+                   flags)
+       != 0)
+        return (FALSE);
+    if(fwrite(buffer, 1, size, fptr) != size) return (FALSE);
+
+    return (TRUE);
+}
+#else
+/*
+   Write RGB or RGBX pixels, components 3 or 4, RGB rows are passed straight to the encoder
+   With libjpeg-turbo so are RGBX rows, the alpha is dropped without a copy, otherwise
+   each row is copied to RGB in the scanline buffer
+*/
+int JPEG_WritePixels(CODEC* codec, FILE* fptr, const unsigned char* pixels, int components, int width, int height, int quality) {
+    size_t index;
+    int j, flip = FALSE;
+    struct jpeg_compress_struct* cinfo = &codec->cinfo;
     JSAMPROW row_pointer[1];
-    JSAMPLE* jimage = NULL;
-    struct jpeg_error_mgr jerr;
 
     if(quality > 0) // Historical
         flip = TRUE;
     quality = ABS(quality);
 
-    if((jimage = malloc(width * 3)) == NULL) return (1);
-
-    // Error handler
-    cinfo.err = jpeg_std_error(&jerr);
-
-    // Initialize JPEG compression object.
-    jpeg_create_compress(&cinfo);
+    // Initialize JPEG compression object, once
+    if(!codec->hascompress) {
+        cinfo->err = jpeg_std_error(&codec->jerr);
+        jpeg_create_compress(cinfo);
+        codec->hascompress = TRUE;
+    }
 
     // Associate with output stream
-    jpeg_stdio_dest(&cinfo, fptr);
+    jpeg_stdio_dest(cinfo, fptr);
 
     // Fill out values
-    cinfo.image_width = width;
-    cinfo.image_height = height;
-    cinfo.input_components = 3;
-    cinfo.in_color_space = JCS_RGB;
+    cinfo->image_width = width;
+    cinfo->image_height = height;
+    cinfo->input_components = 3;
+    cinfo->in_color_space = JCS_RGB;
+#ifdef JCS_EXTENSIONS
+    if(components == 4) {
+        cinfo->input_components = 4;
+        cinfo->in_color_space = JCS_EXT_RGBX;
+    }
+#else
+    JSAMPLE* jimage = NULL;
+    if(components == 4 && (jimage = Codec_Row(codec, width * 3)) == NULL) return (FALSE);
+#endif
 
-    // Default compression settings
-    jpeg_set_defaults(&cinfo);
-    jpeg_set_quality(&cinfo, quality, TRUE); // limit to baseline-JPEG values
+    // Default compression settings, luminance is sampled 2x2 for 4:2:0
+    jpeg_set_defaults(cinfo);
+    jpeg_set_quality(cinfo, quality, TRUE); // limit to baseline-JPEG values
+    if(codec->fullchroma) {
+        cinfo->comp_info[0].h_samp_factor = 1;
+        cinfo->comp_info[0].v_samp_factor = 1;
+    }
 
     // Start cmpressor
-    jpeg_start_compress(&cinfo, TRUE);
-
-    row_pointer[0] = jimage;
+    jpeg_start_compress(cinfo, TRUE);
 
     j = 0;
-    while(cinfo.next_scanline < cinfo.image_height) {
-        for(i = 0; i < width; i++) {
-            if(flip) index = (height - 1 - j) * width + i;
-            else
-                index = j * width + i;
-            jimage[3 * i] = image[index].r;
-            jimage[3 * i + 1] = image[index].g;
-            jimage[3 * i + 2] = image[index].b;
+    while(cinfo->next_scanline < cinfo->image_height) {
+        if(flip) index = (height - 1 - j) * (size_t)width * components;
+        else
+            index = j * (size_t)width * components;
+        row_pointer[0] = (JSAMPROW)&pixels[index];
+#ifndef JCS_EXTENSIONS
+        if(components == 4) {
+            for(int i = 0; i < width; i++) {
+                jimage[3 * i] = pixels[index + 4 * i];
+                jimage[3 * i + 1] = pixels[index + 4 * i + 1];
+                jimage[3 * i + 2] = pixels[index + 4 * i + 2];
+            }
+            row_pointer[0] = jimage;
         }
-        jpeg_write_scanlines(&cinfo, row_pointer, 1);
+#endif
+        jpeg_write_scanlines(cinfo, row_pointer, 1);
         j++;
     }
 
-    jpeg_finish_compress(&cinfo);
-    jpeg_destroy_compress(&cinfo);
+    jpeg_finish_compress(cinfo);
 
-    free(jimage);
     return (TRUE);
 }
+#endif
 
 /*
-   Get dimensions of a JPEG image
+   Get dimensions of a JPEG image, only the header is read
 */
 int JPEG_Info(FILE* fptr, int* width, int* height, int* depth) {
-    int row_stride;
-    struct jpeg_decompress_struct cinfo;
-    struct jpeg_error_mgr jerr;
-    JSAMPARRAY buffer;
+    IMAGEINFO info;
 
-    // Error handler
-    cinfo.err = jpeg_std_error(&jerr);
+    if(Probe_Image(fptr, &info) != JPG) return (FALSE);
+    *width = info.width;
+    *height = info.height;
+    *depth = 8 * info.components;
 
-    jpeg_create_decompress(&cinfo);
-    jpeg_stdio_src(&cinfo, fptr);
+    return (TRUE);
+}
 
-    // Read header
-    jpeg_read_header(&cinfo, TRUE);
+/*
+   Read a JPEG image
+*/
+int JPEG_Read(FILE* fptr, BITMAP4* image, int* width, int* height) {
+    CODEC* codec;
+    int status;
 
-    // Read one scan line
-    jpeg_start_decompress(&cinfo);
-    row_stride = cinfo.output_width * cinfo.output_components;
-    buffer = (*cinfo.mem->alloc_sarray)((j_common_ptr)&cinfo, JPOOL_IMAGE, row_stride, 1);
-    while(cinfo.output_scanline < cinfo.output_height) jpeg_read_scanlines(&cinfo, (JSAMPARRAY)buffer, 1);
+    if((codec = Create_Codec()) == NULL) return (2);
+    status = JPEG_ReadCodec(codec, fptr, image, width, height);
+    Destroy_Codec(codec);
 
-    *width = cinfo.output_width;
-    *height = cinfo.output_height;
-    *depth = 8 * cinfo.output_components;
+    return (status);
+}
 
-    jpeg_finish_decompress(&cinfo);
-    jpeg_destroy_decompress(&cinfo);
+#ifdef ADDTURBOJPEG
+/*
+   As JPEG_Read() with the TurboJPEG API, the file is read into the codec buffer and decoded
+   straight into the bitmap as RGBX, alpha is set to 255, rows bottom up as JPEG_Read() stores them
+   libjpeg-turbo does the colour conversion with SIMD and there is no scanline copy
+*/
+int JPEG_ReadCodec(CODEC* codec, FILE* fptr, BITMAP4* image, int* width, int* height) {
+    long size;
+    unsigned char* buffer;
 
+    // Whole file, TurboJPEG decodes from memory
+    if(fseek(fptr, 0, SEEK_END) != 0 || (size = ftell(fptr)) <= 0) return (1);
     rewind(fptr);
+    if((buffer = Codec_Row(codec, size)) == NULL) return (2);
+    if(fread(buffer, 1, size, fptr) != (size_t)size) return (1);
 
-    return (TRUE);
+    return (JPEG_ReadCodecMem(codec, buffer, size, image, width, height));
 }
 
 /*
-   Read a JPEG image
+   As JPEG_ReadCodec() for a JPEG file already read into memory, no copy is made
 */
-int JPEG_Read(FILE* fptr, BITMAP4* image, int* width, int* height) {
+int JPEG_ReadCodecMem(CODEC* codec, const unsigned char* buffer, size_t size, BITMAP4* image, int* width, int* height) {
+    int w, h, subsamp, colorspace;
+    tjscalingfactor scale = { 1, MAX(1, codec->scaledenom) };
+
+    if(codec->tjdecompress == NULL && (codec->tjdecompress = tjInitDecompress()) == NULL) return (2);
+    if(size == 0) return (1);
+
+    // Can only handle RGB JPEG images at this stage
+    if(tjDecompressHeader3(codec->tjdecompress, buffer, size, &w, &h, &subsamp, &colorspace) != 0) return (1);
+    if(colorspace != TJCS_RGB && colorspace != TJCS_YCbCr) return (1);
+
+    // Scaling is done in the DCT, as with libjpeg
+    *width = TJSCALED(w, scale);
+    *height = TJSCALED(h, scale);
+
+    // Warnings, eg: a truncated file, are not fatal, as with libjpeg
+    if(tjDecompress2(codec->tjdecompress,
+                     buffer,
+                     size,
+                     (unsigned char*)image,
+                     *width,
+                     0,
+                     *height,
+                     TJPF_RGBX,
+                     TJFLAG_BOTTOMUP)
+           != 0
+       && tjGetErrorCode(codec->tjdecompress) != TJERR_WARNING)
+        return (1);
+
+    return (0);
+}
+#else
+/*
+   As JPEG_Read() reusing the decompressor and scanline buffer of a codec
+*/
+int JPEG_ReadCodec(CODEC* codec, FILE* fptr, BITMAP4* image, int* width, int* height) {
+    return (JPEG_DecodeCodec(codec, fptr, NULL, 0, image, width, height));
+}
+
+/*
+   As JPEG_ReadCodec() for a JPEG file already read into memory
+*/
+int JPEG_ReadCodecMem(CODEC* codec, const unsigned char* data, size_t size, BITMAP4* image, int* width, int* height) {
+    if(size == 0) return (1); // libjpeg exits on an empty source
+    return (JPEG_DecodeCodec(codec, NULL, data, size, image, width, height));
+}
+
+/*
+   Decode from the file, or from memory when fptr is NULL
+*/
+int JPEG_DecodeCodec(CODEC* codec,
+                     FILE* fptr,
+                     const unsigned char* data,
+                     size_t size,
+                     BITMAP4* image,
+                     int* width,
+                     int* height) {
     int j;
     int row_stride;
-    struct jpeg_decompress_struct cinfo;
-    struct jpeg_error_mgr jerr;
+    struct jpeg_decompress_struct* cinfo = &codec->dinfo;
     JSAMPLE* buffer;
 
-    // Error handler
-    cinfo.err = jpeg_std_error(&jerr);
-
-    jpeg_create_decompress(&cinfo);
-    jpeg_stdio_src(&cinfo, fptr);
+    // Initialize JPEG decompression object, once
+    if(!codec->hasdecompress) {
+        cinfo->err = jpeg_std_error(&codec->jerr);
+        jpeg_create_decompress(cinfo);
+        codec->hasdecompress = TRUE;
+    }
+    if(fptr != NULL) jpeg_stdio_src(cinfo, fptr);
+    else
+        jpeg_mem_src(cinfo, (unsigned char*)data, size);
 
-    // Read header
-    jpeg_read_header(&cinfo, TRUE);
-    jpeg_start_decompress(&cinfo);
+    // Read header, scaling is done in the DCT
+    jpeg_read_header(cinfo, TRUE);
+    cinfo->scale_num = 1;
+    cinfo->scale_denom = MAX(1, codec->scaledenom);
+    jpeg_start_decompress(cinfo);
 
-    *width = cinfo.output_width;
-    *height = cinfo.output_height;
+    *width = cinfo->output_width;
+    *height = cinfo->output_height;
 
     // Can only handle RGB JPEG images at this stage
-    if(cinfo.output_components != 3) return (1);
+    if(cinfo->output_components != 3) {
+        jpeg_abort_decompress(cinfo);
+        return (1);
+    }
 
     // buffer for one scan line
-    row_stride = cinfo.output_width * cinfo.output_components;
-    if((buffer = malloc(row_stride * sizeof(JSAMPLE))) == NULL) return (2);
-
-    j = cinfo.output_height - 1;
-    while(cinfo.output_scanline < cinfo.output_height) {
-        jpeg_read_scanlines(&cinfo, &buffer, 1);
-        for(size_t i = 0; i < cinfo.output_width; i++) {
-            image[j * cinfo.output_width + i].r = buffer[3 * i];
-            image[j * cinfo.output_width + i].g = buffer[3 * i + 1];
-            image[j * cinfo.output_width + i].b = buffer[3 * i + 2];
-            image[j * cinfo.output_width + i].a = 255;
+    row_stride = cinfo->output_width * cinfo->output_components;
+    if((buffer = Codec_Row(codec, row_stride * sizeof(JSAMPLE))) == NULL) {
+        jpeg_abort_decompress(cinfo);
+        return (2);
+    }
+
+    j = cinfo->output_height - 1;
+    while(cinfo->output_scanline < cinfo->output_height) {
+        jpeg_read_scanlines(cinfo, &buffer, 1);
+        for(size_t i = 0; i < cinfo->output_width; i++) {
+            image[j * cinfo->output_width + i].r = buffer[3 * i];
+            image[j * cinfo->output_width + i].g = buffer[3 * i + 1];
+            image[j * cinfo->output_width + i].b = buffer[3 * i + 2];
+            image[j * cinfo->output_width + i].a = 255;
         }
         j--;
     }
 
-    // Finish
-    jpeg_finish_decompress(&cinfo);
-    jpeg_destroy_decompress(&cinfo);
-    free(buffer);
+    // Finish, the object is ready for the next image
+    jpeg_finish_decompress(cinfo);
 
     return (0);
 }
 #endif
+#endif
 
 #ifdef ADDPNG
 boolean IsPNG(const char* fname) {
@@ -1602,6 +1970,16 @@ int PNG_Info(FILE* fptr, int* width, int* height, int* depth) {
     return (0);
 }
 
+/*
+   libpng allocations through the codec so they are counted
+*/
+png_voidp PNG_CodecMalloc(png_structp png, png_alloc_size_t size) { return (Codec_Malloc(png_get_mem_ptr(png), size)); }
+
+void PNG_CodecFree(png_structp png, png_voidp p) {
+    (void)png;
+    free(p);
+}
+
 /*
    Read the PNG image data
    Return 0 on success
@@ -1611,17 +1989,69 @@ int PNG_Info(FILE* fptr, int* width, int* height, int* depth) {
       3 - Failed to read image data
 */
 int PNG_Read(FILE* fptr, BITMAP4* image, int* owidth, int* oheight) {
-    int index;
+    CODEC* codec;
+    int status;
 
-    png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if((codec = Create_Codec()) == NULL) return (1);
+    status = PNG_ReadCodec(codec, fptr, image, owidth, oheight);
+    Destroy_Codec(codec);
+
+    return (status);
+}
+
+/*
+   As PNG_Read(), libpng can't restart a read struct so that is created each time,
+   the rows are decoded straight into the image using the row pointers of the codec
+*/
+int PNG_ReadCodec(CODEC* codec, FILE* fptr, BITMAP4* image, int* owidth, int* oheight) {
+    return (PNG_DecodeCodec(codec, fptr, NULL, image, owidth, oheight));
+}
+
+/*
+   As PNG_ReadCodec() for a png file already read into memory
+*/
+int PNG_ReadCodecMem(CODEC* codec, const unsigned char* data, size_t size, BITMAP4* image, int* owidth, int* oheight) {
+    PNGSOURCE source = { data, size, 0 };
+
+    return (PNG_DecodeCodec(codec, NULL, &source, image, owidth, oheight));
+}
+
+/*
+   libpng read callback for PNG_ReadCodecMem()
+*/
+void PNG_ReadSource(png_structp png, png_bytep out, png_size_t n) {
+    PNGSOURCE* source = (PNGSOURCE*)png_get_io_ptr(png);
+
+    if(n > source->size - source->pos) png_error(png, "Read past the end of the data");
+    memcpy(out, source->data + source->pos, n);
+    source->pos += n;
+}
+
+/*
+   Decode from the file, or from memory when fptr is NULL
+*/
+int PNG_DecodeCodec(CODEC* codec, FILE* fptr, PNGSOURCE* source, BITMAP4* image, int* owidth, int* oheight) {
+    png_infop info = NULL;
+    png_bytep* row_pointers;
+
+    png_structp png =
+    png_create_read_struct_2(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL, codec, PNG_CodecMalloc, PNG_CodecFree);
     if(!png) return (1);
 
-    png_infop info = png_create_info_struct(png);
-    if(!info) return (1);
+    info = png_create_info_struct(png);
+    if(!info) {
+        png_destroy_read_struct(&png, NULL, NULL);
+        return (1);
+    }
 
-    if(setjmp(png_jmpbuf(png))) return (1);
+    if(setjmp(png_jmpbuf(png))) {
+        png_destroy_read_struct(&png, &info, NULL);
+        return (3);
+    }
 
-    png_init_io(png, fptr);
+    if(fptr != NULL) png_init_io(png, fptr);
+    else
+        png_set_read_fn(png, source, PNG_ReadSource);
     png_read_info(png, info);
 
     int width = png_get_image_width(png, info);
@@ -1648,26 +2078,16 @@ int PNG_Read(FILE* fptr, BITMAP4* image, int* owidth, int* oheight) {
 
     png_read_update_info(png, info);
 
-    int x, y;
-    png_bytep* row_pointers = (png_bytep*)malloc(sizeof(png_bytep) * height);
-    for(y = 0; y < height; y++) row_pointers[y] = (png_byte*)malloc(png_get_rowbytes(png, info));
-
-    png_read_image(png, row_pointers);
-
-    for(y = 0; y < height; y++) {
-        png_byte* row = row_pointers[y];
-        for(x = 0; x < width; x++) {
-            index = (height - 1 - y) * width + x; // bitmaplib convention has 0 at top left
-            png_byte* ptr = &(row[x * 4]);
-            image[index].r = ptr[0];
-            image[index].g = ptr[1];
-            image[index].b = ptr[2];
-            image[index].a = ptr[3];
-        }
+    // Rows are RGBA, the same layout as BITMAP4, bitmaplib convention has 0 at top left
+    if((row_pointers = (png_bytep*)Codec_Rows(codec, height)) == NULL) {
+        png_destroy_read_struct(&png, &info, NULL);
+        return (3);
     }
+    for(int y = 0; y < height; y++) row_pointers[y] = (png_bytep)&image[(height - 1 - y) * width];
 
-    for(y = 0; y < height; y++) free(row_pointers[y]);
-    free(row_pointers);
+    png_read_image(png, row_pointers);
+    png_read_end(png, NULL);
+    png_destroy_read_struct(&png, &info, NULL);
 
     *owidth = width;
     *oheight = height;
@@ -1675,52 +2095,321 @@ int PNG_Read(FILE* fptr, BITMAP4* image, int* owidth, int* oheight) {
 }
 
 int PNG_Write(FILE* fptr, const BITMAP4* image, int width, int height, int flip) {
-    int index;
+    CODEC* codec;
+    int status;
+
+    if((codec = Create_Codec()) == NULL) return (1);
+    status = PNG_WriteCodec(codec, fptr, image, width, height, flip);
+    Destroy_Codec(codec);
+
+    return (status);
+}
+
+/*
+   As PNG_Write(), rows are written straight from the image, no copies are made
+*/
+int PNG_WriteCodec(CODEC* codec, FILE* fptr, const BITMAP4* image, int width, int height, int flip) {
+    return (PNG_WritePixels(codec, fptr, (const unsigned char*)image, 4, width, height, flip));
+}
 
-    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+/*
+   As PNG_WriteCodec() for an RGB bitmap, the png is RGB
+*/
+int PNG_WriteCodec3(CODEC* codec, FILE* fptr, const BITMAP3* image, int width, int height, int flip) {
+    return (PNG_WritePixels(codec, fptr, (const unsigned char*)image, 3, width, height, flip));
+}
+
+/*
+   Write RGB or RGBA pixels, components 3 or 4, as a png of the same colour type
+*/
+int PNG_WritePixels(CODEC* codec, FILE* fptr, const unsigned char* pixels, int components, int width, int height, int flip) {
+    png_infop info = NULL;
+
+    png_structp png =
+    png_create_write_struct_2(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL, codec, PNG_CodecMalloc, PNG_CodecFree);
     if(!png) return (1);
 
-    png_infop info = png_create_info_struct(png);
-    if(!info) return (1);
+    info = png_create_info_struct(png);
+    if(!info) {
+        png_destroy_write_struct(&png, NULL);
+        return (1);
+    }
 
-    if(setjmp(png_jmpbuf(png))) abort();
+    if(setjmp(png_jmpbuf(png))) {
+        png_destroy_write_struct(&png, &info);
+        return (1);
+    }
 
     png_init_io(png, fptr);
+    png_set_compression_level(png, codec->pnglevel);
+    if(codec->pngfilter >= 0) png_set_filter(png, PNG_FILTER_TYPE_BASE, PNG_FILTER_NONE << codec->pngfilter);
 
-    // Output is 8bit depth, RGBA format.
+    // Output is 8bit depth, RGB or RGBA format.
     png_set_IHDR(png,
                  info,
                  width,
                  height,
                  8,
-                 PNG_COLOR_TYPE_RGBA,
+                 (components == 3) ? PNG_COLOR_TYPE_RGB : PNG_COLOR_TYPE_RGBA,
                  PNG_INTERLACE_NONE,
                  PNG_COMPRESSION_TYPE_DEFAULT,
                  PNG_FILTER_TYPE_DEFAULT);
     png_write_info(png, info);
 
-    int x, y;
-    png_bytep* row_pointers = (png_bytep*)malloc(sizeof(png_bytep) * height);
-    for(y = 0; y < height; y++) row_pointers[y] = (png_byte*)malloc(png_get_rowbytes(png, info));
+    for(int y = 0; y < height; y++) {
+        size_t index = (flip ? y : (height - 1 - y)) * (size_t)width * components;
+        png_write_row(png, &pixels[index]);
+    }
+    png_write_end(png, NULL);
+    png_destroy_write_struct(&png, &info);
 
-    for(y = 0; y < height; y++) {
-        png_byte* row = row_pointers[y];
-        for(x = 0; x < width; x++) {
-            if(!flip) index = (height - 1 - y) * width + x;
-            else
-                index = y * width + x;
-            png_byte* ptr = &(row[x * 4]);
-            ptr[0] = image[index].r;
-            ptr[1] = image[index].g;
-            ptr[2] = image[index].b;
-            ptr[3] = image[index].a;
+    return (0);
+}
+#endif
+
+#ifdef ADDPNG
+/*
+   zlib allocations for the codec, counted as for libpng
+*/
+voidpf PNG_CodecZalloc(voidpf opaque, uInt items, uInt size) { return (Codec_Malloc(opaque, (size_t)items * size)); }
+
+void PNG_CodecZfree(voidpf opaque, voidpf p) {
+    (void)opaque;
+    free(p);
+}
+
+/*
+   Get nbands bands ready for PNG_DeflateBand(), for rows width wide of RGB or RGBA pixels,
+   components 3 or 4, up to bandheight rows each
+   Everything is allocated here, in the calling thread, and kept for the next image
+   Return 0 on success as the other PNG_*() functions
+*/
+int PNG_InitBands(CODEC* codec, int nbands, int components, int width, int bandheight) {
+    size_t rowbytes = components * (size_t)width + 1;
+    size_t worksize = (5 + (32768 + rowbytes - 1) / rowbytes) * rowbytes;
+
+    if(nbands > codec->nbands) {
+        PNGBAND* bands;
+        if((bands = Codec_Malloc(codec, nbands * sizeof(PNGBAND))) == NULL) return (1);
+
+        // zlib state points back at its z_stream, so a stream can't be moved, it is made again below
+        for(int n = 0; n < codec->nbands; n++) {
+            if(codec->bands[n].hasstrm) deflateEnd(&codec->bands[n].strm);
+            codec->bands[n].hasstrm = FALSE;
         }
+        if(codec->nbands > 0) memcpy(bands, codec->bands, codec->nbands * sizeof(PNGBAND));
+        memset(&bands[codec->nbands], 0, (nbands - codec->nbands) * sizeof(PNGBAND));
+        free(codec->bands);
+        codec->bands = bands;
+        codec->nbands = nbands;
     }
-    png_write_image(png, row_pointers);
-    png_write_end(png, NULL);
 
-    for(y = 0; y < height; y++) free(row_pointers[y]);
-    free(row_pointers);
+    for(int n = 0; n < nbands; n++) {
+        PNGBAND* b = &codec->bands[n];
+        if(b->hasstrm && b->level != codec->pnglevel) {
+            deflateEnd(&b->strm);
+            b->hasstrm = FALSE;
+        }
+        if(!b->hasstrm) {
+            b->strm.zalloc = PNG_CodecZalloc;
+            b->strm.zfree = PNG_CodecZfree;
+            b->strm.opaque = codec;
+            if(deflateInit2(&b->strm, codec->pnglevel, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) return (1);
+            b->hasstrm = TRUE;
+            b->level = codec->pnglevel;
+        }
+
+        // Room for the whole band even if it doesn't compress, plus the sync flush
+        size_t outsize = deflateBound(&b->strm, bandheight * rowbytes) + 16;
+        if(outsize > b->outsize) {
+            free(b->out);
+            if((b->out = Codec_Malloc(codec, outsize)) == NULL) {
+                b->outsize = 0;
+                return (1);
+            }
+            b->outsize = outsize;
+        }
+        if(worksize > b->worksize) {
+            free(b->work);
+            if((b->work = Codec_Malloc(codec, worksize)) == NULL) {
+                b->worksize = 0;
+                return (1);
+            }
+            b->worksize = worksize;
+        }
+    }
+
+    return (0);
+}
+
+/*
+   Filter a row of n bytes, bpp bytes per pixel, prev is the row above or NULL for the first row
+   With filter -1 each filter is tried and the one with the smallest sum of absolute differences
+   is used, as libpng does, scratch holds the 5 candidates
+*/
+void PNG_FilterRow(unsigned char* out, const unsigned char* row, const unsigned char* prev, size_t n, size_t bpp, int filter, unsigned char* scratch) {
+
+    if(filter < 0) {
+        unsigned long best = 0;
+        int bestfilter = 0;
+        for(int f = PNG_FILTER_VALUE_NONE; f <= PNG_FILTER_VALUE_PAETH; f++) {
+            unsigned char* candidate = &scratch[f * (n + 1)];
+            unsigned long sum = 0;
+            PNG_FilterRow(candidate, row, prev, n, bpp, f, NULL);
+            for(size_t i = 1; i <= n; i++) sum += (candidate[i] < 128) ? candidate[i] : 256 - candidate[i];
+            if(f == PNG_FILTER_VALUE_NONE || sum < best) {
+                best = sum;
+                bestfilter = f;
+            }
+        }
+        memcpy(out, &scratch[bestfilter * (n + 1)], n + 1);
+        return;
+    }
+
+    out[0] = filter;
+    out++;
+    for(size_t i = 0; i < n; i++) {
+        int a = (i >= bpp) ? row[i - bpp] : 0;
+        int b = (prev != NULL) ? prev[i] : 0;
+        int c = (prev != NULL && i >= bpp) ? prev[i - bpp] : 0;
+        switch(filter) {
+        case PNG_FILTER_VALUE_NONE: out[i] = row[i]; break;
+        case PNG_FILTER_VALUE_SUB: out[i] = row[i] - a; break;
+        case PNG_FILTER_VALUE_UP: out[i] = row[i] - b; break;
+        case PNG_FILTER_VALUE_AVG: out[i] = row[i] - ((a + b) >> 1); break;
+        default: {
+            int p = a + b - c, pa = ABS(p - a), pb = ABS(p - b), pc = ABS(p - c);
+            out[i] = row[i] - ((pa <= pb && pa <= pc) ? a : (pb <= pc) ? b : c);
+        } break;
+        }
+    }
+}
+
+/*
+   Filter and deflate rows y0 ... y1-1 of an RGB or RGBA png into band n, rows counted from the top of the png
+   Bands are independent so they can be done on separate threads, pigz style: each is a raw deflate
+   stream primed with the last 32K of filtered rows before it and ended with a sync flush, or finished
+   if it is the last band, so concatenated they form one deflate stream
+   The codec must have been prepared with PNG_InitBands(), nothing is allocated here
+*/
+int PNG_DeflateBand(CODEC* codec, int n, const unsigned char* pixels, int components, int width, int height, int flip, int y0, int y1) {
+    PNGBAND* b = &codec->bands[n];
+    size_t rowbytes = components * (size_t)width;
+    unsigned char* scratch = b->work;
+    unsigned char* filtered = &b->work[5 * (rowbytes + 1)];
+    int ndict = (32768 + rowbytes) / (rowbytes + 1);
+
+    #define PNGROW(y) (&pixels[(flip ? (y) : (height - 1 - (y))) * rowbytes])
+
+    if(deflateReset(&b->strm) != Z_OK) return (1);
+    b->strm.next_out = b->out;
+    b->strm.avail_out = b->outsize;
+
+    // Dictionary, the filtered rows before the band, as the previous band saw them
+    if(y0 > 0) {
+        int d0 = MAX(0, y0 - ndict);
+        for(int y = d0; y < y0; y++)
+            PNG_FilterRow(&filtered[(y - d0) * (rowbytes + 1)], PNGROW(y), (y > 0) ? PNGROW(y - 1) : NULL, rowbytes, components, codec->pngfilter, scratch);
+        size_t dictlen = (y0 - d0) * (rowbytes + 1);
+        size_t skip = (dictlen > 32768) ? dictlen - 32768 : 0;
+        if(deflateSetDictionary(&b->strm, &filtered[skip], dictlen - skip) != Z_OK) return (1);
+    }
+
+    b->adler = adler32(0L, Z_NULL, 0);
+    b->inlen = 0;
+    for(int y = y0; y < y1; y++) {
+        PNG_FilterRow(filtered, PNGROW(y), (y > 0) ? PNGROW(y - 1) : NULL, rowbytes, components, codec->pngfilter, scratch);
+        b->adler = adler32(b->adler, filtered, rowbytes + 1);
+        b->inlen += rowbytes + 1;
+        b->strm.next_in = filtered;
+        b->strm.avail_in = rowbytes + 1;
+        if(deflate(&b->strm, Z_NO_FLUSH) != Z_OK || b->strm.avail_in != 0) return (1);
+    }
+    #undef PNGROW
+
+    if(y1 >= height) {
+        if(deflate(&b->strm, Z_FINISH) != Z_STREAM_END) return (1);
+    } else {
+        if(deflate(&b->strm, Z_SYNC_FLUSH) != Z_OK || b->strm.avail_out == 0) return (1);
+    }
+    b->outlen = b->outsize - b->strm.avail_out;
+
+    return (0);
+}
+
+void PNG_PutBigEndian(unsigned char* p, unsigned long value) {
+    p[0] = (value >> 24) & 0xff;
+    p[1] = (value >> 16) & 0xff;
+    p[2] = (value >> 8) & 0xff;
+    p[3] = value & 0xff;
+}
+
+/*
+   Write a png chunk, the data may be given in pieces which are written one after the other
+*/
+int PNG_WriteChunk(FILE* fptr, const char* type, int npieces, const unsigned char** pieces, const size_t* lengths) {
+    unsigned char buffer[4];
+    size_t length = 0;
+    unsigned long crc;
+
+    for(int i = 0; i < npieces; i++) length += lengths[i];
+    PNG_PutBigEndian(buffer, length);
+    if(fwrite(buffer, 1, 4, fptr) != 4 || fwrite(type, 1, 4, fptr) != 4) return (1);
+    crc = crc32(0L, (const Bytef*)type, 4);
+    for(int i = 0; i < npieces; i++) {
+        if(fwrite(pieces[i], 1, lengths[i], fptr) != lengths[i]) return (1);
+        crc = crc32(crc, pieces[i], lengths[i]);
+    }
+    PNG_PutBigEndian(buffer, crc);
+    if(fwrite(buffer, 1, 4, fptr) != 4) return (1);
+
+    return (0);
+}
+
+/*
+   Write an RGB or RGBA png whose rows have been deflated by PNG_DeflateBand() into bands 0 ... nbands-1
+   The bands are joined into one zlib stream in a single IDAT chunk, the zlib header is made for the
+   level and the adler32 checksum is combined from those of the bands
+*/
+int PNG_WriteBands(CODEC* codec, FILE* fptr, int components, int width, int height, int nbands) {
+    const unsigned char signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+    unsigned char ihdr[13], zheader[2], ztrailer[4];
+    const unsigned char* pieces[nbands + 2];
+    size_t lengths[nbands + 2];
+    unsigned long adler = adler32(0L, Z_NULL, 0);
+
+    if(fwrite(signature, 1, 8, fptr) != 8) return (1);
+
+    PNG_PutBigEndian(ihdr, width);
+    PNG_PutBigEndian(&ihdr[4], height);
+    ihdr[8] = 8; // Bit depth
+    ihdr[9] = (components == 3) ? PNG_COLOR_TYPE_RGB : PNG_COLOR_TYPE_RGBA;
+    ihdr[10] = PNG_COMPRESSION_TYPE_DEFAULT;
+    ihdr[11] = PNG_FILTER_TYPE_DEFAULT;
+    ihdr[12] = PNG_INTERLACE_NONE;
+    pieces[0] = ihdr;
+    lengths[0] = 13;
+    if(PNG_WriteChunk(fptr, "IHDR", 1, pieces, lengths)) return (1);
+
+    // zlib header, 32K window, level hint as zlib would write it
+    int level = (codec->pnglevel == Z_DEFAULT_COMPRESSION) ? 6 : codec->pnglevel;
+    int flevel = (level < 2) ? 0 : (level < 6) ? 1 : (level == 6) ? 2 : 3;
+    zheader[0] = 0x78;
+    zheader[1] = flevel << 6;
+    zheader[1] += 31 - (zheader[0] * 256 + zheader[1]) % 31;
+    pieces[0] = zheader;
+    lengths[0] = 2;
+    for(int n = 0; n < nbands; n++) {
+        pieces[n + 1] = codec->bands[n].out;
+        lengths[n + 1] = codec->bands[n].outlen;
+        adler = adler32_combine(adler, codec->bands[n].adler, codec->bands[n].inlen);
+    }
+    PNG_PutBigEndian(ztrailer, adler);
+    pieces[nbands + 1] = ztrailer;
+    lengths[nbands + 1] = 4;
+    if(PNG_WriteChunk(fptr, "IDAT", nbands + 2, pieces, lengths)) return (1);
+
+    if(PNG_WriteChunk(fptr, "IEND", 0, pieces, lengths)) return (1);
 
     return (0);
 }
@@ -12,8 +12,12 @@
 #ifdef ADDJPEG
     #include <jpeglib.h>
 #endif
+#ifdef ADDTURBOJPEG
+    #include <turbojpeg.h> // JPEG_ReadCodec() and JPEG_WriteCodec() use the TurboJPEG API, set in the Makefile
+#endif
 #ifdef ADDPNG
     #include <png.h>
+    #include <zlib.h>
 #endif
 #ifdef ADDTIFF
     #include <tiffio.h>
@@ -85,6 +89,61 @@ typedef struct {
     char imagedescriptor;
 } TGAHEADER;
 
+// Image header details, from Probe_Image()
+typedef struct {
+    int width, height;
+    int components; // Colour channels including any alpha, palette images have 1
+    int bitdepth; // Bits per channel
+} IMAGEINFO;
+
+#ifdef ADDPNG
+// A band of rows of a png deflated on its own, see PNG_DeflateBand()
+typedef struct {
+    z_stream strm;
+    int hasstrm, level;
+    unsigned char* out; // Raw deflate data, ends on a byte boundary
+    size_t outsize, outlen;
+    unsigned long adler; // Of the filtered rows of the band
+    size_t inlen;
+    unsigned char* work; // Filtered rows, for the dictionary and trying each filter
+    size_t worksize;
+} PNGBAND;
+
+// A png in memory, see PNG_ReadCodecMem()
+typedef struct {
+    const unsigned char* data;
+    size_t size, pos;
+} PNGSOURCE;
+#endif
+
+// Codec state kept between images, so repeated reads and writes don't rebuild it
+typedef struct {
+#ifdef ADDJPEG
+    struct jpeg_decompress_struct dinfo;
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    int hasdecompress, hascompress;
+    int scaledenom; // Decode at 1/scaledenom, 1, 2, 4 or 8, 0 is the same as 1
+    int fullchroma; // Encode 4:4:4 rather than 4:2:0
+#endif
+#ifdef ADDTURBOJPEG
+    tjhandle tjdecompress, tjcompress;
+#endif
+#ifdef ADDPNG
+    int pnglevel; // zlib level 0 to 9, Z_DEFAULT_COMPRESSION for the default
+    int pngfilter; // Row filter, PNG_FILTER_VALUE_NONE to PNG_FILTER_VALUE_PAETH, -1 to choose per row
+    PNGBAND* bands; // For writing a png band by band
+    int nbands;
+#endif
+    unsigned char* row; // Scanline buffer, with TurboJPEG the whole compressed image
+    size_t rowsize;
+    void** rows; // Row pointers
+    int nrows;
+    long nalloc; // Allocations made for the codec, including those of libpng
+    long allocbytes;
+    double alloctime; // Seconds spent in malloc
+} CODEC;
+
 // *** for BMP
 typedef struct {
     unsigned short int type; /* Magic identifier            */
@@ -110,8 +169,11 @@ typedef struct {
 
 BITMAP4* Create_Bitmap(int, int);
 void Destroy_Bitmap(BITMAP4*);
+BITMAP3* Create_Bitmap3(int, int);
+void Destroy_Bitmap3(BITMAP3*);
 void Write_Bitmap(FILE*, BITMAP4*, int, int, int);
 void Erase_Bitmap(BITMAP4*, int, int, BITMAP4);
+void Erase_Bitmap3(BITMAP3*, int, int, BITMAP3);
 void GaussianScale(BITMAP4*, int, int, BITMAP4*, int, int, double);
 void BiCubicScale(BITMAP4*, int, int, BITMAP4*, int, int);
 double BiCubicR(double);
@@ -151,11 +213,27 @@ int Read_UShort(FILE*, unsigned short*, int);
 int Write_UShort(FILE*, unsigned short, int);
 int Read_UInt(FILE*, unsigned int*, int);
 
+long BM_ReadBigEndian(FILE*, int);
+CODEC* Create_Codec(void);
+void Destroy_Codec(CODEC*);
+void* Codec_Malloc(CODEC*, size_t);
+unsigned char* Codec_Row(CODEC*, size_t);
+void** Codec_Rows(CODEC*, int);
+int Detect_Format(FILE*);
+int Detect_FormatMem(const unsigned char*, size_t);
+int Probe_Image(FILE*, IMAGEINFO*);
+
 #ifdef ADDJPEG
 boolean IsJPEG(const char*);
 int JPEG_Write(FILE*, BITMAP4*, int, int, int);
 int JPEG_Info(FILE*, int*, int*, int*);
 int JPEG_Read(FILE*, BITMAP4*, int*, int*);
+int JPEG_WriteCodec(CODEC*, FILE*, const BITMAP4*, int, int, int);
+int JPEG_WriteCodec3(CODEC*, FILE*, const BITMAP3*, int, int, int);
+int JPEG_WritePixels(CODEC*, FILE*, const unsigned char*, int, int, int, int);
+int JPEG_ReadCodec(CODEC*, FILE*, BITMAP4*, int*, int*);
+int JPEG_ReadCodecMem(CODEC*, const unsigned char*, size_t, BITMAP4*, int*, int*);
+int JPEG_DecodeCodec(CODEC*, FILE*, const unsigned char*, size_t, BITMAP4*, int*, int*);
 #endif
 
 #ifdef ADDPNG
@@ -163,6 +241,16 @@ boolean IsPNG(const char*);
 int PNG_Write(FILE* fptr, const BITMAP4*, int, int, int);
 int PNG_Info(FILE*, int*, int*, int*);
 int PNG_Read(FILE*, BITMAP4*, int*, int*);
+int PNG_WriteCodec(CODEC*, FILE*, const BITMAP4*, int, int, int);
+int PNG_WriteCodec3(CODEC*, FILE*, const BITMAP3*, int, int, int);
+int PNG_WritePixels(CODEC*, FILE*, const unsigned char*, int, int, int, int);
+int PNG_ReadCodec(CODEC*, FILE*, BITMAP4*, int*, int*);
+int PNG_ReadCodecMem(CODEC*, const unsigned char*, size_t, BITMAP4*, int*, int*);
+void PNG_ReadSource(png_structp, png_bytep, png_size_t);
+int PNG_DecodeCodec(CODEC*, FILE*, PNGSOURCE*, BITMAP4*, int*, int*);
+int PNG_InitBands(CODEC*, int, int, int, int);
+int PNG_DeflateBand(CODEC*, int, const unsigned char*, int, int, int, int, int, int);
+int PNG_WriteBands(CODEC*, FILE*, int, int, int, int);
 #endif
 
 #ifdef ADDTIFF
@@ -1,4 +1,14 @@
 #include "max2sphere.h"
+#if defined(__x86_64__) || defined(__i386__)
+    #define REMAP_X86
+    #include <immintrin.h>
+#endif
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 /*
     Convert a sequence of pairs of frames from the GoPro MAX camera to an equirectangular
@@ -24,12 +34,146 @@ LLTABLE* g_lltable = NULL;
 int ntable = 0;
 int itable = 0;
 
+// Pre-resolved lookup table, the frame pixel indices and seam blend weight are baked in
+// For samples outside a seam dx and weight are 0 so the gather is branch free
+#define GATHER_FRAME2 0x80000000u
+typedef struct {
+    unsigned int index; // Pixel index into the frame, the top bit selects frame 2
+    short int dx; // Offset from index to the second pixel of a seam blend
+    unsigned short int weight; // Weight of the second pixel, 0 ... 256
+} GATHERTABLE;
+GATHERTABLE* g_gathertable = NULL;
 
-int main(int argc, char** argv) {
-    char tablename[256];
-    double x, y, dx, dy, x0, y0, longitude, latitude;
-    FILE* fptr;
+// Gather table for bilinear sampling, the 2x2 pixels from index are interpolated, and those from index + dx
+// for the other half of a seam blend, the pixels are kept inside the face region when the table is built
+typedef struct {
+    unsigned int index; // Top left pixel of the 2x2, the top bit selects frame 2
+    short int dx; // Offset from index to the top left pixel of the other half of a seam blend
+    unsigned short int weight; // Weight of the other half, 0 ... 256
+    unsigned short int wx1, wx2; // Weight of the right column of each half, 0 ... 256
+    unsigned short int wy, pad; // Weight of the lower row, 0 ... 256
+} BILINEARTABLE;
+BILINEARTABLE* g_bilineartable = NULL;
+
+// Packed lookup table, (u,v) in fixed point and the face in one 32 bit word
+// The face is in the top 3 bits, then v and u, a third of the memory traffic of LLTABLE
+#define PACKED_UBITS 15
+#define PACKED_VBITS 14
+typedef unsigned int PACKEDTABLE;
+PACKEDTABLE* g_packedtable = NULL;
+
+const char* tableformatname[NTABLEFORMAT] = { "uv", "gather", "folded", "packed" };
+
+// Seam blend weights, 0 ... 256, across the blend band
+#define BLENDSTEPS 256
+const char* blendcurvename[NBLENDCURVE] = { "tanh", "linear", "smoothstep" };
+
+const char* samplingname[NSAMPLING] = { "supersample", "nearest", "bilinear" };
+
+// Png row filters, in the order of their filter type values, -f
+#define NPNGFILTER 5
+const char* pngfiltername[NPNGFILTER] = { "none", "sub", "up", "average", "paeth" };
+
+const char* manifeststatusname[NMANIFESTSTATUS] = { "exists", "written", "failed" };
+unsigned short int g_blendweight[BLENDSTEPS + 1];
+
+// Gather table kernel, chosen at run time from what the CPU supports
+void (*RemapGatherKernel)(const BITMAP4*, const BITMAP4*, BITMAP3*, int, int, int) = RemapGatherSpan;
+
+// Output formats streamed in frame order, besides PNG and JPG of bitmaplib
+#define Y4M 100
+#define RAWRGB 101
+
+// RGB to YUV for streamed output, chosen by SelectRemapKernel() as the gather kernel
+void (*RGBToYUV444Kernel)(const BITMAP3*, unsigned char*, unsigned char*, unsigned char*, int) = RGBToYUV444Span;
+void (*RGBToYUV420Kernel)(const BITMAP3*, const BITMAP3*, unsigned char*, unsigned char*, unsigned char*, unsigned char*, int) =
+RGBToYUV420Span;
+
+// Lookup table cache file, a fixed size header followed by the table entries
+// The version must be bumped whenever the layout of LLTABLE or GATHERTABLE changes
+#define TABLE_MAGIC "M2SPHLUT"
+#define TABLE_VERSION 3
+#define TABLE_BYTEORDER 0x01020304
+#define TABLE_HEADERSIZE 128
+typedef struct {
+    char magic[8];
+    unsigned int version;
+    unsigned int byteorder; // Catches tables moved between machines of different endianness
+    unsigned int format; // TABLE_UV, TABLE_GATHER, ...
+    unsigned int elementsize; // Size of one table entry
+    unsigned int headersize; // Offset of the table entries in the file
+    FRAMESPECS framespecs; // Frame template the table was built for
+    int outwidth, outheight;
+    unsigned int antialias;
+    unsigned int blendcurve; // Baked into gather tables
+    unsigned int tilesize; // Table order, 0 for rows
+    unsigned long long n; // Number of table entries
+    unsigned long long checksum; // Of the table entries
+} TABLEHEADER;
+
+// A table in use, either mapped from the cache file or malloced
+typedef struct {
+    void* base; // Start of the mapping, NULL if malloced
+    size_t length; // Length of the mapping
+    void* data; // The table entries
+} TABLEFILE;
+TABLEFILE g_tablefile = { NULL, 0, NULL };
+
+// Rows of a table shared out to threads in chunks
+typedef struct {
+    void (*func)(void*, int, int); // Processes rows j0 ... j1-1
+    void* arg;
+    int nrows, chunk;
+    int nextrow;
+    pthread_mutex_t mutex;
+} ROWJOB;
+
+// Conversion of rows of the (u,v) table into another format
+typedef struct {
+    const LLTABLE* lltable;
+    void* table;
+} CONVERTJOB;
+
+// Reference rendering of a frame, without a table
+typedef struct {
+    BITMAP4 *frame1, *frame2;
+    BITMAP3* spherical;
+} REFERENCEJOB;
+
+void BuildGatherTable(const LLTABLE*, GATHERTABLE*, int, int);
+void BuildBilinearTable(const LLTABLE*, BILINEARTABLE*, int, int);
+void GatherRows(void*, int, int);
+void PackRows(void*, int, int);
+PACKEDTABLE PackUV(int, UV);
+int UnpackUV(PACKEDTABLE, UV*);
+size_t TableElementSize(int);
+size_t TableOffset(int, int);
+int UnfoldUV(int, int, UV*);
+void GenerateUVTable(void*, int, int);
+void GenerateFoldedTable(void*, int, int);
+int FoldedRows(void);
+int FoldedColumns(void);
 
+// Face and (u,v) change from the folded table to the rest of the sphere
+typedef struct {
+    short int face; // Face after the transform
+    boolean swap; // Exchange u and v
+    boolean flipu, flipv; // Replace u by 1-u, v by 1-v, after any swap
+} UVTRANSFORM;
+UVTRANSFORM g_unfold[2][4][6]; // [mirror][quadrant][face]
+void InitUnfold(void);
+int UnfoldEntry(const LLTABLE*, const UVTRANSFORM*, UV*);
+void ParallelRows(void (*)(void*, int, int), void*, int);
+void* RowJobWorker(void*);
+void TableFileName(char*, int);
+void FillTableHeader(TABLEHEADER*, int, size_t, const void*);
+unsigned long long TableChecksum(const void*, size_t);
+boolean MapTable(TABLEFILE*, const char*, int, size_t);
+boolean SaveTable(const char*, int, size_t, const void*);
+void ReleaseTable(TABLEFILE*);
+
+
+int main(int argc, char** argv) {
     // Default settings
     Init();
 
@@ -57,29 +201,232 @@ int main(int argc, char** argv) {
             params.debug = TRUE;
         } else if(strcmp(argv[i], "-F") == 0) {
             params.skip_existing = FALSE;
+        } else if(strcmp(argv[i], "-J") == 0) {
+#ifdef JOURNALING_ENABLED
+            snprintf(params.journal, sizeof(params.journal), "%s", argv[i + 1]);
+#else
+            fprintf(stderr, "%s() - Built without JOURNALING_ENABLED, -J ignored\n", argv[0]);
+#endif
+        } else if(strcmp(argv[i], "-M") == 0) {
+            params.minsize = MAX(0, atol(argv[i + 1]));
         } else if(strcmp(argv[i], "-t") == 0) {
             params.threads = MAX(1, atoi(argv[i + 1]));
+        } else if(strcmp(argv[i], "-l") == 0) {
+            int format = 0;
+            while(format < NTABLEFORMAT && strcmp(argv[i + 1], tableformatname[format]) != 0) format++;
+            if(format < NTABLEFORMAT) params.tableformat = format;
+            else
+                fprintf(stderr, "%s() - Unknown lookup table format \"%s\", ignored\n", argv[0], argv[i + 1]);
+        } else if(strcmp(argv[i], "-V") == 0) {
+            params.validate = TRUE;
+        } else if(strcmp(argv[i], "-k") == 0) {
+            if(strcmp(argv[i + 1], "scalar") == 0) params.kernel = KERNEL_SCALAR;
+            else if(strcmp(argv[i + 1], "auto") == 0)
+                params.kernel = KERNEL_AUTO;
+            else
+                fprintf(stderr, "%s() - Unknown kernel \"%s\", ignored\n", argv[0], argv[i + 1]);
+        } else if(strcmp(argv[i], "-b") == 0) {
+            int curve = 0;
+            while(curve < NBLENDCURVE && strcmp(argv[i + 1], blendcurvename[curve]) != 0) curve++;
+            if(curve < NBLENDCURVE) params.blendcurve = curve;
+            else
+                fprintf(stderr, "%s() - Unknown blend curve \"%s\", ignored\n", argv[0], argv[i + 1]);
+        } else if(strcmp(argv[i], "-s") == 0) {
+            int sampling = 0;
+            while(sampling < NSAMPLING && strcmp(argv[i + 1], samplingname[sampling]) != 0) sampling++;
+            if(sampling < NSAMPLING) params.sampling = sampling;
+            else
+                fprintf(stderr, "%s() - Unknown sampling \"%s\", ignored\n", argv[0], argv[i + 1]);
+        } else if(strcmp(argv[i], "-T") == 0) {
+            params.tilesize = MAX(0, atoi(argv[i + 1]));
+            params.tilesize = 8 * ((params.tilesize + 7) / 8); // Whole vector blocks
+        } else if(strcmp(argv[i], "-r") == 0) {
+            if(strcmp(argv[i + 1], "auto") == 0) params.framescale = 0;
+            else
+                params.framescale = MAX(1, MIN(8, atoi(argv[i + 1])));
+        } else if(strcmp(argv[i], "-e") == 0) {
+            if(strcmp(argv[i + 1], "png") == 0) params.outformat = PNG;
+            else if(strcmp(argv[i + 1], "jpg") == 0 || strcmp(argv[i + 1], "jpeg") == 0)
+                params.outformat = JPG;
+            else if(strcmp(argv[i + 1], "y4m") == 0)
+                params.outformat = Y4M;
+            else if(strcmp(argv[i + 1], "rgb") == 0)
+                params.outformat = RAWRGB;
+            else
+                fprintf(stderr, "%s() - Unknown output format \"%s\", ignored\n", argv[0], argv[i + 1]);
+        } else if(strcmp(argv[i], "-q") == 0) {
+            params.quality = MAX(1, MIN(100, atoi(argv[i + 1])));
+        } else if(strcmp(argv[i], "-c") == 0) {
+            if(strcmp(argv[i + 1], "444") == 0) params.fullchroma = TRUE;
+            else if(strcmp(argv[i + 1], "420") == 0)
+                params.fullchroma = FALSE;
+            else
+                fprintf(stderr, "%s() - Unknown chroma subsampling \"%s\", ignored\n", argv[0], argv[i + 1]);
+        } else if(strcmp(argv[i], "-z") == 0) {
+            params.pnglevel = MAX(0, MIN(9, atoi(argv[i + 1])));
+        } else if(strcmp(argv[i], "-f") == 0) {
+            int filter = 0;
+            while(filter < NPNGFILTER && strcmp(argv[i + 1], pngfiltername[filter]) != 0) filter++;
+            if(filter < NPNGFILTER) params.pngfilter = filter;
+            else if(strcmp(argv[i + 1], "adaptive") == 0)
+                params.pngfilter = -1;
+            else
+                fprintf(stderr, "%s() - Unknown png filter \"%s\", ignored\n", argv[0], argv[i + 1]);
+        } else if(strcmp(argv[i], "-p") == 0) {
+            params.parallelpng = TRUE;
+        } else if(strcmp(argv[i], "-R") == 0) {
+            if(strchr(argv[i + 1], ':') != NULL) snprintf(params.framerate, sizeof(params.framerate), "%s", argv[i + 1]);
+            else
+                sprintf(params.framerate, "%d:1", MAX(1, atoi(argv[i + 1])));
+        } else if(strcmp(argv[i], "-W") == 0) {
+            params.window = MAX(1, atoi(argv[i + 1]));
+        } else if(strcmp(argv[i], "-D") == 0) {
+            params.decodethreads = MAX(1, atoi(argv[i + 1]));
+        } else if(strcmp(argv[i], "-E") == 0) {
+            params.encodethreads = MAX(1, atoi(argv[i + 1]));
+        } else if(strcmp(argv[i], "-i") == 0) {
+            if(strcmp(argv[i + 1], "rgb") == 0) params.informat = STREAM_RGB;
+            else if(strcmp(argv[i + 1], "yuv420") == 0)
+                params.informat = STREAM_YUV420;
+            else if(strcmp(argv[i + 1], "y4m") == 0)
+                params.informat = STREAM_Y4M;
+            else
+                fprintf(stderr, "%s() - Unknown input format \"%s\", ignored\n", argv[0], argv[i + 1]);
+        } else if(strcmp(argv[i], "-S") == 0) {
+            if(sscanf(argv[i + 1], "%dx%d", &params.streamwidth, &params.streamheight) != 2)
+                fprintf(stderr, "%s() - Stream frame size \"%s\" should be WxH, ignored\n", argv[0], argv[i + 1]);
+        } else if(strcmp(argv[i], "--shard") == 0) {
+            if(sscanf(argv[i + 1], "%d/%d", &params.shard, &params.nshards) != 2 || params.nshards < 1 || params.shard < 1
+               || params.shard > params.nshards) {
+                fprintf(stderr, "%s() - Shard \"%s\" should be k/N, k from 1 to N\n", argv[0], argv[i + 1]);
+                exit(-1);
+            }
+        } else if(strcmp(argv[i], "--chunk") == 0) {
+            params.chunk = MAX(0, atoi(argv[i + 1]));
+        } else if(strcmp(argv[i], "--lease") == 0) {
+            snprintf(params.leasedir, sizeof(params.leasedir), "%s", argv[i + 1]);
+        } else if(strcmp(argv[i], "--merge") == 0) {
+            snprintf(params.mergedir, sizeof(params.mergedir), "%s", argv[i + 1]);
+        } else if(strcmp(argv[i], "-P") == 0) {
+            params.prefetch = MAX(0, atoi(argv[i + 1]));
+        } else if(strcmp(argv[i], "-B") == 0) {
+            params.benchmark = MAX(1, atoi(argv[i + 1]));
+        }
+    }
+
+    // One sample per pixel when nearest
+    if(params.sampling == SAMPLING_NEAREST) {
+        params.antialias = 1;
+        params.antialias2 = 1;
+    }
+
+    if(params.tableformat == TABLE_FOLDED && params.tilesize > 0) {
+        if(params.debug) fprintf(stderr, "%s() - Folded tables are in row order, tiles ignored\n", argv[0]);
+        params.tilesize = 0;
+    }
+
+    // Output format from the name of the output template unless given, png by default, y4m to stdout for "-"
+    if(params.outformat < 0) {
+        if(strcmp(params.outfilename, "-") == 0 || strstr(params.outfilename, ".y4m") != NULL) params.outformat = Y4M;
+        else if(strstr(params.outfilename, ".rgb") != NULL)
+            params.outformat = RAWRGB;
+        else
+            params.outformat = (strlen(params.outfilename) > 2 && IsJPEG(params.outfilename)) ? JPG : PNG;
+    }
+    boolean streaming = (params.outformat == Y4M || params.outformat == RAWRGB);
+
+    // Streams of frames are named by one %d for the track, or as a pair, no frame is skipped so they stay in step
+    boolean streamed = (params.informat != STREAM_NONE);
+    if(streamed) {
+        params.skip_existing = FALSE;
+        if(params.benchmark > 0) {
+            fprintf(stderr, "%s() - Benchmarking needs frames as images, not streams\n", argv[0]);
+            exit(-1);
         }
     }
 
-    // Check filename templates
-    if(!CheckTemplate(argv[argc - 1], 2)) // Fatal
+    // Check filename templates, a stream is one file, pipe or stdout
+    if(!streamed && !CheckTemplate(argv[argc - 1], 2)) // Fatal
         exit(-1);
-    if(strlen(params.outfilename) > 2) {
+    if(streaming) {
+        params.skip_existing = FALSE;
+    } else if(strlen(params.outfilename) > 2) {
         if(!CheckTemplate(params.outfilename, 1)) // Delete user selected output filename template
             params.outfilename[0] = '\0';
     }
+    if(streamed && !streaming && strlen(params.outfilename) < 2) {
+        fprintf(stderr, "%s() - Frames read from streams need an output filename template, see -o\n", argv[0]);
+        exit(-1);
+    }
 
 
     char fname1[256], fname2[256];
+    boolean isjpeg = FALSE;
+    SOURCE source;
+
+    // The frames present in both tracks, listed once rather than tried one number after another
+    size_t* framelist = NULL;
+    size_t nframes = (params.n_stop >= params.n_start) ? params.n_stop - params.n_start + 1 : 0;
+    if(!streamed && (framelist = FindFrames(argv[0], argv[argc - 1], &nframes)) != NULL && nframes == 0) {
+        fprintf(stderr, "%s() - No frames found in both tracks from %li to %li\n", argv[0], params.n_start, params.n_stop);
+        exit(-1);
+    }
+    size_t firstframe = (framelist != NULL) ? framelist[0] : params.n_start;
+
+    // Shards are taken from the list, the same in every process, leased chunks are claimed as the threads need them
+    boolean leasing = (strlen(params.leasedir) > 0);
+    boolean sharded = (leasing || params.nshards > 1);
+    if((sharded || strlen(params.mergedir) > 0) && (framelist == NULL || streaming)) {
+        fprintf(stderr, "%s() - Shards need frames listed from the track directories, written as images\n", argv[0]);
+        exit(-1);
+    }
+    if(strlen(params.mergedir) > 0) exit(MergeManifests(argv[0], argv[argc - 1], framelist, nframes) ? 0 : -1);
+    MANIFEST manifest;
+    LEASE lease;
+    char manifestdir[256], manifestname[256];
+    if(leasing) {
+        snprintf(manifestdir, sizeof(manifestdir), "%s", params.leasedir);
+        if(!InitManifest(&manifest, NULL, 0, nframes)) exit(-1);
+        if(!InitLease(&lease, argv[0], argv[argc - 1], framelist, nframes, &manifest)) exit(-1);
+        snprintf(manifestname, sizeof(manifestname), "lease_%s_%d.manifest", lease.host, (int)getpid());
+    } else if(sharded) {
+        OutputDirectory(argv[argc - 1], firstframe, manifestdir, sizeof(manifestdir));
+        snprintf(manifestname, sizeof(manifestname), "shard_%d_of_%d.manifest", params.shard, params.nshards);
+        size_t nlisted = nframes;
+        nframes = SelectShard(framelist, nframes);
+        if(!InitManifest(&manifest, framelist, nframes, nframes)) exit(-1);
+        if(params.debug) {
+            fprintf(stderr,
+                    "%s() - Shard %d of %d has %li of %li frames\n",
+                    argv[0],
+                    params.shard,
+                    params.nshards,
+                    nframes,
+                    nlisted);
+        }
+    }
 
+    // Frames already written are dropped before any thread sees them, those in the journal if one is kept
+    if(streaming) params.journal[0] = '\0';
+    if(framelist != NULL && params.skip_existing && !leasing) {
+        size_t nlisted = nframes;
+        nframes = DropDone(argv[0], argv[argc - 1], framelist, nframes);
+        if(nframes == 0) {
+            fprintf(stderr, "%s() - All %li frames have been done already, see -F\n", argv[0], nlisted);
+            if(sharded) exit(WriteManifest(&manifest, argv[0], argv[argc - 1], manifestdir, manifestname) ? 0 : -1);
+            exit(0);
+        }
+    }
 
-    // Check the first frame to determine template and frame sizes
-    set_frame_filename_from_template(fname1, fname2, params.n_start, argv[argc - 1]);
-    // sprintf(fname1, argv[argc - 1], 0, params.n_start);
-    // sprintf(fname2, argv[argc - 1], 5, params.n_start);
-    // if(params.debug) fprintf(stderr, "fname1=%s fname2=%s\n", fname1, fname2);
-    if((whichtemplate = CheckFrames(fname1, fname2, &params.framewidth, &params.frameheight)) < 0) exit(-1);
+    // Check the first frame to determine template and frame sizes, streams are opened and their size checked
+    if(streamed) {
+        if(!OpenSource(&source, argv[0], argv[argc - 1])) exit(-1);
+        whichtemplate = CheckFrames(NULL, NULL, &params.framewidth, &params.frameheight, &isjpeg);
+    } else {
+        set_frame_filename_from_template(fname1, fname2, firstframe, argv[argc - 1]);
+        whichtemplate = CheckFrames(fname1, fname2, &params.framewidth, &params.frameheight, &isjpeg);
+    }
+    if(whichtemplate < 0) exit(-1);
     if(params.debug) {
         fprintf(stderr, "%s() - frame dimensions: %li × %li\n", argv[0], params.framewidth, params.frameheight);
         fprintf(stderr, "%s() - Expect frame template %d\n", argv[0], whichtemplate + 1);
@@ -89,375 +436,3644 @@ int main(int argc, char** argv) {
         params.outwidth = template[whichtemplate].equi_width;
         params.outheight = params.outwidth / 2;
     }
+    ScaleFrames(argv[0], isjpeg);
 
-    // Does a table exist? If it does, load it. if not, create it and save it
-    ntable = params.outheight * params.outwidth * params.antialias * params.antialias;
-    g_lltable = malloc(ntable * sizeof(LLTABLE));
-    sprintf(tablename, "%d_%d_%d_%li.data", whichtemplate, params.outwidth, params.outheight, params.antialias);
-    int n = 0;
-    if((fptr = fopen(tablename, "r")) != NULL) {
-        if(params.debug) fprintf(stderr, "%s() - Reading lookup table\n", argv[0]);
-        if((n = fread(g_lltable, sizeof(LLTABLE), ntable, fptr)) != ntable) {
-            fprintf(stderr, "%s() - Failed to read lookup table \"%s\" (%d != %d)\n", argv[0], tablename, n, ntable);
-        }
-        fclose(fptr);
-    }
-    if(n != ntable) {
-        if(params.debug) fprintf(stderr, "%s() - Generating lookup table\n", argv[0]);
-        dx = params.antialias * params.outwidth;
-        dy = params.antialias * params.outheight;
-        itable = 0;
-        for(int j = 0; j < params.outheight; j++) {
-            y0 = j / (double)params.outheight;
-            for(int i = 0; i < params.outwidth; i++) {
-                x0 = i / (double)params.outwidth;
-                for(size_t aj = 0; aj < params.antialias; aj++) {
-                    y = y0 + aj / dy; // 0 ... 1
-                    for(size_t ai = 0; ai < params.antialias; ai++) {
-                        x = x0 + ai / dx; // 0 ... 1
-                        longitude = x * TWOPI - M_PI; // -pi ... pi
-                        latitude = y * M_PI - M_PI / 2; // -pi/2 ... pi/2
-                        g_lltable[itable].face = FindFaceUV(longitude, latitude, &(g_lltable[itable].uv));
-                        itable++;
-                    }
-                }
-            }
-        }
-        if(params.debug) fprintf(stderr, "%s() - Saving lookup table\n", argv[0]);
-        fptr = fopen(tablename, "w");
-        fwrite(g_lltable, ntable, sizeof(LLTABLE), fptr);
-        fclose(fptr);
+    InitBlend();
+
+    // Does a table exist? If it does, map it. if not, create it and save it
+    if(!MakeLookupTable(argv[0])) exit(-1);
+    if(params.validate) exit(ValidateTable(argv[0]) ? 0 : -1);
+    SelectRemapKernel(argv[0]);
+    if(params.benchmark > 0) exit(Benchmark(argv[0], argv[argc - 1], firstframe) ? 0 : -1);
+
+    // Threads of each stage, remapping uses -t, the stage that sets the pace gets as many
+    if(params.decodethreads == 0) params.decodethreads = streamed ? 1 : MAX(1, (int)params.threads / 2);
+    if(params.encodethreads == 0) {
+        if(streaming) params.encodethreads = 1;
+        else if(params.outformat == PNG && !params.parallelpng)
+            params.encodethreads = params.threads;
+        else
+            params.encodethreads = MAX(1, (int)params.threads / 2);
     }
+    if(params.window == 0) params.window = MAX((int)params.threads, MAX(params.decodethreads, params.encodethreads)) + 2;
+    if(params.prefetch < 0) params.prefetch = 2 * params.decodethreads;
+    if(streamed || leasing) params.prefetch = 0;
+    int nthreads = params.decodethreads + params.threads + params.encodethreads;
 
+    if(params.debug) {
+        fprintf(stderr,
+                "%s() - Starting %d decode, %li remap and %d encode threads, %d frames in flight\n",
+                argv[0],
+                params.decodethreads,
+                params.threads,
+                params.encodethreads,
+                params.window);
+    }
 
-    if(params.debug) fprintf(stderr, "%s() - Starting threads\n", argv[0]);
+    // All remap threads are used even for a single frame, they then share out its bands
+    pthread_t thread[nthreads];
+    THREAD_DATA data[nthreads];
 
-    params.threads = MIN(params.threads, params.n_stop);
+    SCHEDULER scheduler;
+    InitScheduler(&scheduler, leasing ? lease.claimed : framelist, leasing ? 0 : nframes);
+    if(leasing) scheduler.lease = &lease;
+    PIPELINE pipeline;
+    if(!OpenPipeline(&pipeline, argv[0], params.window) || !InitQueue(&scheduler.decoded, params.window)) exit(-1);
+    scheduler.ndecoders = params.decodethreads;
+    pipeline.nremappers = params.threads;
 
-    pthread_t thread[params.threads];
-    THREAD_DATA data[params.threads];
+    SINK sink;
+    if(streaming && !OpenSink(&sink, argv[0], 0, params.window)) exit(-1);
+    PREFETCH prefetch;
+    if(params.prefetch > 0 && !StartPrefetch(&prefetch, argv[0], argv[argc - 1], framelist, nframes, params.prefetch))
+        exit(-1);
+#ifdef JOURNALING_ENABLED
+    JOURNAL journal;
+    if(strlen(params.journal) > 0 && !OpenJournal(&journal, argv[0])) exit(-1);
+#endif
 
-    pthread_mutex_t mutex_counter = PTHREAD_MUTEX_INITIALIZER;
-    size_t shared_counter = params.n_start;
+    for(int thread_id = 0; thread_id < nthreads; thread_id++) {
+        boolean decoder = (thread_id < params.decodethreads);
+        boolean encoder = (thread_id >= nthreads - params.encodethreads);
 
-    for(size_t thread_id = 0; thread_id < params.threads; thread_id++) {
         // Initialize the thread data
         data[thread_id].worker_id = thread_id;
-        data[thread_id].counter_mutex = &mutex_counter;
-        data[thread_id].ip_shared_counter = &shared_counter;
+        data[thread_id].scheduler = &scheduler;
+        data[thread_id].sink = streaming ? &sink : NULL;
+        data[thread_id].source = streamed ? &source : NULL;
+        data[thread_id].prefetch = (decoder && params.prefetch > 0) ? &prefetch : NULL;
+        data[thread_id].manifest = sharded ? &manifest : NULL;
+        data[thread_id].pipeline = &pipeline;
+#ifdef JOURNALING_ENABLED
+        data[thread_id].journal = (strlen(params.journal) > 0) ? &journal : NULL;
+#endif
         data[thread_id].progName = argv[0];
         data[thread_id].last_argument = argv[argc - 1];
 
-        // Malloc images (once, then reuse in the same thread)
-        data[thread_id].frame_input1 = Create_Bitmap(params.framewidth, params.frameheight);
-        data[thread_id].frame_input2 = Create_Bitmap(params.framewidth, params.frameheight);
-        data[thread_id].frame_spherical = Create_Bitmap(params.outwidth, params.outheight);
+        // Malloc buffers (once, then reuse in the same thread)
+        data[thread_id].frame_raw = (decoder && streamed) ? malloc(2 * source.framesize) : NULL;
+        data[thread_id].codec = (decoder || encoder) ? Create_Codec() : NULL;
+        if((decoder && streamed && data[thread_id].frame_raw == NULL) || ((decoder || encoder) && data[thread_id].codec == NULL)) {
+            fprintf(stderr, "%s() - Failed to malloc memory for the threads\n", argv[0]);
+            exit(-1);
+        }
 
-        int creating_thread_status =
-        pthread_create(&(thread[thread_id]), NULL, worker_function, (void*)&data[thread_id]);
+        void* (*stage)(void*) = decoder ? DecodeWorker : (encoder ? EncodeWorker : worker_function);
+        int creating_thread_status = pthread_create(&(thread[thread_id]), NULL, stage, (void*)&data[thread_id]);
         if(creating_thread_status) {
-            if(params.debug) { fprintf(stderr, "Error creating thread %02li, exiting.\n", thread_id); }
+            if(params.debug) { fprintf(stderr, "Error creating thread %02d, exiting.\n", thread_id); }
             exit(-1);
         } else if(params.debug) {
-            if(params.debug) { fprintf(stderr, "%s() - Started Thread %02li\n", argv[0], thread_id); }
-        }
-
-        if(params.threads > 1) {
-            // spread start of threads out a bit so compute and io time do not overlap at the start
-            usleep(1000.0 / (params.threads + 1));
+            if(params.debug) { fprintf(stderr, "%s() - Started Thread %02d\n", argv[0], thread_id); }
         }
     }
 
-    for(size_t thread_id = 0; thread_id < params.threads; ++thread_id) {
+    for(int thread_id = 0; thread_id < nthreads; ++thread_id) {
         pthread_join(thread[thread_id], NULL);
 
-        Destroy_Bitmap(data[thread_id].frame_input1);
-        Destroy_Bitmap(data[thread_id].frame_input2);
-        Destroy_Bitmap(data[thread_id].frame_spherical);
+        free(data[thread_id].frame_raw);
 
-        if(params.debug) { fprintf(stderr, "Thread: %02li done\n", thread_id); }
+        if(params.debug) {
+            fprintf(stderr, "Thread: %02d done\n", thread_id);
+            if(data[thread_id].codec != NULL) {
+                fprintf(stderr,
+                        "Thread: %02d codec made %ld allocations, %ld bytes, %.3f ms in malloc\n",
+                        thread_id,
+                        data[thread_id].codec->nalloc,
+                        data[thread_id].codec->allocbytes,
+                        1000 * data[thread_id].codec->alloctime);
+            }
+        }
+        if(data[thread_id].codec != NULL) Destroy_Codec(data[thread_id].codec);
     }
+    DestroyScheduler(&scheduler);
+    ClosePipeline(&pipeline);
+    if(streaming) CloseSink(&sink, argv[0]);
+    if(streamed) CloseSource(&source, argv[0]);
+    if(params.prefetch > 0) StopPrefetch(&prefetch, argv[0]);
+    if(sharded) {
+        WriteManifest(&manifest, argv[0], argv[argc - 1], manifestdir, manifestname);
+        FreeManifest(&manifest);
+    }
+    if(leasing) FreeLease(&lease, argv[0]);
+#ifdef JOURNALING_ENABLED
+    if(strlen(params.journal) > 0) CloseJournal(&journal, argv[0]);
+#endif
+    free(framelist);
 
-    free(g_lltable);
+    ReleaseTable(&g_tablefile);
     exit(0);
 }
 
 
-void set_frame_filename_from_template(char* fname1, char* fname2, int nframe, const char* last_argument) {
-    sprintf(fname1, last_argument, 0, nframe);
-    sprintf(fname2, last_argument, 5, nframe);
+void set_frame_filename_from_template(char* fname1, char* fname2, int nframe, const char* last_argument) {
+    sprintf(fname1, last_argument, 0, nframe);
+    sprintf(fname2, last_argument, 5, nframe);
+}
+
+
+/*
+    Decode stage, claim the next frame once there is a free buffer for it, read it and pass it to the remap stage
+    When leasing and none are left the next chunk is claimed from the other processes
+    Frames that are skipped, or past the end of the streams, go straight back to the pool
+*/
+void* DecodeWorker(void* input) {
+    THREAD_DATA* data = (THREAD_DATA*)input;
+    SCHEDULER* scheduler = data->scheduler;
+    FRAMEBUFFER* buffer;
+
+    while((buffer = TakeBuffer(data->pipeline)) != NULL) {
+        pthread_mutex_lock(&scheduler->mutex);
+        if(scheduler->nextframe >= scheduler->endframe && scheduler->lease != NULL) {
+            pthread_mutex_unlock(&scheduler->mutex);
+            LeaseChunk(scheduler, data->progName);
+            pthread_mutex_lock(&scheduler->mutex);
+        }
+        if(scheduler->nextframe >= scheduler->endframe) {
+            pthread_mutex_unlock(&scheduler->mutex);
+            GiveBuffer(data->pipeline, buffer);
+            break;
+        }
+        buffer->index = scheduler->nextframe++;
+        buffer->nframe = (scheduler->framelist != NULL) ? scheduler->framelist[buffer->index] : params.n_start + buffer->index;
+        scheduler->nactive++;
+        pthread_mutex_unlock(&scheduler->mutex);
+
+        if(params.debug) {
+            fprintf(stderr, "%s() T%02li - starting job %li\n", data->progName, data->worker_id, buffer->nframe);
+        }
+        if(DecodeFrame(data, buffer)) {
+            pthread_mutex_lock(&scheduler->mutex);
+            PutQueue(&scheduler->decoded, buffer);
+            pthread_cond_broadcast(&scheduler->cond);
+            pthread_mutex_unlock(&scheduler->mutex);
+        } else {
+            size_t index = buffer->index;
+            GiveBuffer(data->pipeline, buffer);
+            EndFrame(scheduler, index, TRUE);
+        }
+    }
+
+    pthread_mutex_lock(&scheduler->mutex);
+    scheduler->ndecoders--;
+    pthread_cond_broadcast(&scheduler->cond);
+    pthread_mutex_unlock(&scheduler->mutex);
+    if(params.debug) { fprintf(stderr, "%s() T%02li - finished decoding\n", data->progName, data->worker_id); }
+    return NULL;
+}
+
+/*
+    Remap stage, decoded frames are taken first, when there are none the thread helps form the bands
+    of the frames in progress, or deflate those being encoded, it finishes when no frames are left
+    A thread with no pipeline only helps with bands, until the scheduler has no frame active
+*/
+void* worker_function(void* input) {
+    // Cast the pointer to the correct type
+    THREAD_DATA* data = (THREAD_DATA*)input;
+    SCHEDULER* scheduler = data->scheduler;
+
+    pthread_mutex_lock(&scheduler->mutex);
+    for(;;) {
+        if(scheduler->decoded.count > 0) {
+            FRAMEBUFFER* buffer = TakeQueue(&scheduler->decoded);
+            pthread_mutex_unlock(&scheduler->mutex);
+
+            if(buffer->ok) {
+                if(params.debug) {
+                    fprintf(stderr,
+                            "%s() T%02li - Creating spherical map for frame %li\n",
+                            data->progName,
+                            data->worker_id,
+                            buffer->nframe);
+                }
+                double starttime = GetRunTime();
+                BITMAP3 black = { 0, 0, 0 };
+                Erase_Bitmap3(buffer->spherical, params.outwidth, params.outheight, black);
+                RemapShared(scheduler, buffer->frame1, buffer->frame2, buffer->spherical);
+                if(params.debug) {
+                    fprintf(stderr,
+                            "%s() T%02li - Processing time: %g seconds\n",
+                            data->progName,
+                            data->worker_id,
+                            GetRunTime() - starttime);
+                }
+            }
+            PassFormed(data->pipeline, buffer);
+
+            pthread_mutex_lock(&scheduler->mutex);
+        } else if(scheduler->jobs != NULL) {
+            RemapBand(scheduler, scheduler->jobs);
+        } else if(scheduler->ndecoders > 0 || scheduler->nactive > 0) {
+            pthread_cond_wait(&scheduler->cond, &scheduler->mutex);
+        } else {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&scheduler->mutex);
+
+    if(data->pipeline != NULL) {
+        pthread_mutex_lock(&data->pipeline->mutex);
+        data->pipeline->nremappers--;
+        pthread_cond_broadcast(&data->pipeline->cond);
+        pthread_mutex_unlock(&data->pipeline->mutex);
+    }
+    if(params.debug) { fprintf(stderr, "%s() T%02li - finished all jobs\n", data->progName, data->worker_id); }
+    return NULL;
+}
+
+/*
+    Encode stage, write each formed frame or pass it to the stream, and give its buffer back
+    A frame that couldn't be read leaves a gap in a stream, with images there is nothing to write
+*/
+void* EncodeWorker(void* input) {
+    THREAD_DATA* data = (THREAD_DATA*)input;
+    FRAMEBUFFER* buffer;
+
+    while((buffer = TakeFormed(data->pipeline)) != NULL) {
+        // Write out the equirectangular
+        // Base the name on the name of the first frame
+        if(params.debug) fprintf(stderr, "%s() T%02li - Saving equirectangular\n", data->progName, data->worker_id);
+        boolean written = FALSE;
+        if(data->sink != NULL) SinkFrame(data->sink, buffer->index, buffer->ok ? buffer->spherical : NULL);
+        else if(buffer->ok) {
+            written =
+            WriteSpherical(data->scheduler, data->codec, buffer->fname, buffer->nframe, buffer->spherical, params.outwidth, params.outheight);
+#ifdef JOURNALING_ENABLED
+            if(written && data->journal != NULL) JournalFrame(data->journal, buffer->nframe, buffer->fname);
+#endif
+        }
+        if(data->manifest != NULL) {
+            RecordManifest(data->manifest, buffer->nframe, written ? MANIFEST_WRITTEN : MANIFEST_FAILED);
+        }
+        if(params.debug) {
+            fprintf(stderr, "%s() T%02li - finished job %li\n", data->progName, data->worker_id, buffer->nframe);
+        }
+        size_t index = buffer->index;
+        boolean ok = (data->sink != NULL) ? buffer->ok : written;
+        GiveBuffer(data->pipeline, buffer);
+        EndFrame(data->scheduler, index, ok);
+    }
+    if(params.debug) { fprintf(stderr, "%s() T%02li - finished encoding\n", data->progName, data->worker_id); }
+    return NULL;
+}
+
+/*
+    A frame has left the pipeline, written or dropped, the last frame of a leased chunk finishes the chunk
+    A frame skipped, or past the end of the streams, is not a failure
+    The lease directory is often a network mount, so its files are only touched once the mutex is released
+*/
+void EndFrame(SCHEDULER* scheduler, size_t index, boolean ok) {
+    int state = CHUNK_NONE;
+    size_t chunk = 0;
+
+    pthread_mutex_lock(&scheduler->mutex);
+    if(scheduler->lease != NULL) state = LeaseFrame(scheduler->lease, index, ok, &chunk);
+    if(--scheduler->nactive == 0) pthread_cond_broadcast(&scheduler->cond);
+    pthread_mutex_unlock(&scheduler->mutex);
+
+    if(state == CHUNK_LEFT) TouchChunk(chunk);
+    else if(state == CHUNK_DONE)
+        FinishChunk(chunk);
+}
+
+/*
+    The frames claimed are framelist[0 ... nframes-1], or without a list n_start on
+    With a lease the list starts empty and grows as chunks are claimed, LeaseChunk()
+*/
+void InitScheduler(SCHEDULER* scheduler, size_t* framelist, size_t nframes) {
+    pthread_mutex_init(&scheduler->mutex, NULL);
+    pthread_cond_init(&scheduler->cond, NULL);
+    scheduler->nextframe = 0;
+    scheduler->endframe = nframes;
+    scheduler->framelist = framelist;
+    scheduler->nactive = 0;
+    scheduler->jobs = NULL;
+    scheduler->decoded.items = NULL;
+    scheduler->decoded.count = 0;
+    scheduler->ndecoders = 0;
+    scheduler->lease = NULL;
+}
+
+void DestroyScheduler(SCHEDULER* scheduler) {
+    pthread_mutex_destroy(&scheduler->mutex);
+    pthread_cond_destroy(&scheduler->cond);
+    DestroyQueue(&scheduler->decoded);
+}
+
+/*
+    Frames are passed between the stages in rings with room for every buffer, so putting never has to wait
+*/
+boolean InitQueue(QUEUE* queue, int capacity) {
+    queue->capacity = capacity;
+    queue->head = 0;
+    queue->count = 0;
+    if((queue->items = malloc(capacity * sizeof(FRAMEBUFFER*))) == NULL) {
+        fprintf(stderr, "InitQueue() - Failed to malloc the queue of %d frames\n", capacity);
+        return (FALSE);
+    }
+    return (TRUE);
+}
+
+void PutQueue(QUEUE* queue, FRAMEBUFFER* buffer) {
+    queue->items[(queue->head + queue->count++) % queue->capacity] = buffer;
+}
+
+FRAMEBUFFER* TakeQueue(QUEUE* queue) {
+    FRAMEBUFFER* buffer = queue->items[queue->head];
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->count--;
+    return (buffer);
+}
+
+void DestroyQueue(QUEUE* queue) {
+    free(queue->items);
+    queue->items = NULL;
+}
+
+/*
+    Create the pool of nbuffers frames in flight, memory is set by the number of buffers rather than of threads
+*/
+boolean OpenPipeline(PIPELINE* pipeline, const char* progName, int nbuffers) {
+    pthread_mutex_init(&pipeline->mutex, NULL);
+    pthread_cond_init(&pipeline->cond, NULL);
+    pipeline->nbuffers = nbuffers;
+    pipeline->nremappers = 0;
+    if((pipeline->buffers = calloc(nbuffers, sizeof(FRAMEBUFFER))) == NULL || !InitQueue(&pipeline->pool, nbuffers) ||
+       !InitQueue(&pipeline->formed, nbuffers)) {
+        fprintf(stderr, "%s() - Failed to malloc the frame buffers\n", progName);
+        return (FALSE);
+    }
+    for(int n = 0; n < nbuffers; n++) {
+        FRAMEBUFFER* buffer = &pipeline->buffers[n];
+        buffer->frame1 = Create_Bitmap(params.framewidth, params.frameheight);
+        buffer->frame2 = Create_Bitmap(params.framewidth, params.frameheight);
+        buffer->spherical = Create_Bitmap3(params.outwidth, params.outheight);
+        if(buffer->frame1 == NULL || buffer->frame2 == NULL || buffer->spherical == NULL) {
+            fprintf(stderr, "%s() - Failed to malloc memory for the images\n", progName);
+            return (FALSE);
+        }
+        PutQueue(&pipeline->pool, buffer);
+    }
+    return (TRUE);
+}
+
+void ClosePipeline(PIPELINE* pipeline) {
+    for(int n = 0; n < pipeline->nbuffers; n++) {
+        Destroy_Bitmap(pipeline->buffers[n].frame1);
+        Destroy_Bitmap(pipeline->buffers[n].frame2);
+        Destroy_Bitmap3(pipeline->buffers[n].spherical);
+    }
+    free(pipeline->buffers);
+    DestroyQueue(&pipeline->pool);
+    DestroyQueue(&pipeline->formed);
+    pthread_mutex_destroy(&pipeline->mutex);
+    pthread_cond_destroy(&pipeline->cond);
+}
+
+/*
+    Wait for a free buffer
+*/
+FRAMEBUFFER* TakeBuffer(PIPELINE* pipeline) {
+    pthread_mutex_lock(&pipeline->mutex);
+    while(pipeline->pool.count == 0) pthread_cond_wait(&pipeline->cond, &pipeline->mutex);
+    FRAMEBUFFER* buffer = TakeQueue(&pipeline->pool);
+    pthread_mutex_unlock(&pipeline->mutex);
+    return (buffer);
+}
+
+void GiveBuffer(PIPELINE* pipeline, FRAMEBUFFER* buffer) {
+    pthread_mutex_lock(&pipeline->mutex);
+    PutQueue(&pipeline->pool, buffer);
+    pthread_cond_broadcast(&pipeline->cond);
+    pthread_mutex_unlock(&pipeline->mutex);
+}
+
+void PassFormed(PIPELINE* pipeline, FRAMEBUFFER* buffer) {
+    pthread_mutex_lock(&pipeline->mutex);
+    PutQueue(&pipeline->formed, buffer);
+    pthread_cond_broadcast(&pipeline->cond);
+    pthread_mutex_unlock(&pipeline->mutex);
+}
+
+/*
+    Wait for a formed frame, NULL once the remap stage has finished and none are left
+*/
+FRAMEBUFFER* TakeFormed(PIPELINE* pipeline) {
+    FRAMEBUFFER* buffer = NULL;
+
+    pthread_mutex_lock(&pipeline->mutex);
+    while(pipeline->formed.count == 0 && pipeline->nremappers > 0) pthread_cond_wait(&pipeline->cond, &pipeline->mutex);
+    if(pipeline->formed.count > 0) buffer = TakeQueue(&pipeline->formed);
+    pthread_mutex_unlock(&pipeline->mutex);
+    return (buffer);
+}
+
+/*
+    Form a frame with the help of any thread that is free, the frame is split into bands of rows,
+    whole bands of tiles when the table is in tile order, and the bands are shared out
+    Returns once all the bands are done
+*/
+void RemapShared(SCHEDULER* scheduler, BITMAP4* frame1, BITMAP4* frame2, BITMAP3* spherical) {
+    REMAPJOB job = { frame1, frame2, spherical, 0, 0, 0, 0, NULL, RemapJobBand, NULL, FALSE };
+    int tileheight = (params.tilesize > 0) ? params.tilesize : 1;
+
+    if(params.threads <= 1) {
+        RemapFrame(frame1, frame2, spherical, 0, params.outheight);
+        return;
+    }
+
+    // About 4 bands per thread, so a band of the frames near the poles doesn't hold things up
+    job.bandheight = MAX(1, params.outheight / (4 * (int)params.threads));
+    job.bandheight = tileheight * ((job.bandheight + tileheight - 1) / tileheight);
+    job.nbands = (params.outheight + job.bandheight - 1) / job.bandheight;
+
+    ShareBands(scheduler, &job);
+}
+
+/*
+    Deflate a png of the spherical image with the help of any thread that is free, pigz style
+    The rows are split into bands, each filtered and deflated on its own by PNG_DeflateBand(),
+    and the bands are then joined into one stream by this thread
+    Threads that have no frame left to take help, so spare cores go to encoding
+*/
+boolean EncodeShared(SCHEDULER* scheduler, CODEC* codec, const BITMAP3* spherical, FILE* fptr) {
+    REMAPJOB job = { NULL, NULL, (BITMAP3*)spherical, 0, 0, 0, 0, NULL, DeflateJobBand, codec, FALSE };
+    int rowbytes = 3 * params.outwidth + 1;
+
+    // At least 128K of rows per band, so the flush at the end of a band costs little
+    job.bandheight = MAX((131072 + rowbytes - 1) / rowbytes, params.outheight / (4 * (int)params.threads));
+    job.nbands = (params.outheight + job.bandheight - 1) / job.bandheight;
+    if(PNG_InitBands(codec, job.nbands, 3, params.outwidth, job.bandheight)) return (FALSE);
+
+    ShareBands(scheduler, &job);
+    if(job.failed) return (FALSE);
+
+    return (!PNG_WriteBands(codec, fptr, 3, params.outwidth, params.outheight, job.nbands));
+}
+
+/*
+    Add a job to the scheduler and help with its bands, returns once they are all done
+*/
+void ShareBands(SCHEDULER* scheduler, REMAPJOB* job) {
+    // Oldest frame first, so frames finish in the order they were started
+    pthread_mutex_lock(&scheduler->mutex);
+    REMAPJOB** last = &scheduler->jobs;
+    while(*last != NULL) last = &(*last)->next;
+    *last = job;
+    pthread_cond_broadcast(&scheduler->cond);
+    while(job->nextband < job->nbands) RemapBand(scheduler, job);
+    while(job->ndone < job->nbands) pthread_cond_wait(&scheduler->cond, &scheduler->mutex);
+    pthread_mutex_unlock(&scheduler->mutex);
+}
+
+boolean RemapJobBand(REMAPJOB* job, int band) {
+    int j0 = band * job->bandheight;
+    RemapFrame(job->frame1, job->frame2, job->spherical, j0, MIN(j0 + job->bandheight, params.outheight));
+    return (TRUE);
+}
+
+boolean DeflateJobBand(REMAPJOB* job, int band) {
+    int y0 = band * job->bandheight;
+    return (!PNG_DeflateBand(job->codec,
+                             band,
+                             (const unsigned char*)job->spherical,
+                             3,
+                             params.outwidth,
+                             params.outheight,
+                             FALSE,
+                             y0,
+                             MIN(y0 + job->bandheight, params.outheight)));
+}
+
+/*
+    Claim the next band of a frame and form or deflate it, called and returns with the scheduler locked
+    The frame is taken off the list once its last band has been claimed
+*/
+void RemapBand(SCHEDULER* scheduler, REMAPJOB* job) {
+    int band = job->nextband++;
+
+    if(job->nextband == job->nbands) {
+        REMAPJOB** p = &scheduler->jobs;
+        while(*p != job) p = &(*p)->next;
+        *p = job->next;
+    }
+    pthread_mutex_unlock(&scheduler->mutex);
+
+    boolean status = job->doband(job, band);
+
+    pthread_mutex_lock(&scheduler->mutex);
+    if(!status) job->failed = TRUE;
+    if(++job->ndone == job->nbands) pthread_cond_broadcast(&scheduler->cond);
+}
+
+
+/*
+    Read the frames of buffer->nframe, from images or the streams
+    Returns FALSE when the frame is skipped, or past the end of the streams, it then isn't passed on
+    A frame that fails to read is passed on, not ok, so a stream can carry on past it
+*/
+boolean DecodeFrame(THREAD_DATA* data, FRAMEBUFFER* buffer) {
+    size_t nframe = buffer->nframe;
+    char fname2[256];
+    set_frame_filename_from_template(buffer->fname, fname2, nframe, data->last_argument);
+
+    // Frames in a list have been checked already, FilterDone()
+    if(params.skip_existing && data->scheduler->framelist == NULL) {
+        // Create the output file name
+        char fname_out[256];
+        create_output_filename(fname_out, buffer->fname, nframe);
+
+        if(access(fname_out, F_OK) == 0) {
+            if(params.debug) {
+                fprintf(stderr,
+                        "%s() T%02li - skipping frame, already exists \"%s\"\n",
+                        data->progName,
+                        data->worker_id,
+                        fname_out);
+            }
+            if(data->prefetch != NULL) ReleasePrefetched(data->prefetch, TakePrefetched(data->prefetch, buffer->index));
+            return (FALSE);
+        } else if(params.debug) {
+            fprintf(stderr, "%s() T%02li - NOT skipping frame \"%s\"\n", data->progName, data->worker_id, fname_out);
+        }
+    }
+
+    // Read both frames, from the streams in frame order, no more frames are claimed once they end
+    buffer->ok = FALSE;
+    if(data->source != NULL) {
+        if(!ReadSourceFrames(data->source, nframe, data->frame_raw)) {
+            pthread_mutex_lock(&data->scheduler->mutex);
+            data->scheduler->endframe = MIN(data->scheduler->endframe, buffer->index);
+            pthread_mutex_unlock(&data->scheduler->mutex);
+            return (FALSE);
+        }
+        SourceToFrame(data->source, data->frame_raw, buffer->frame1);
+        SourceToFrame(data->source, data->frame_raw + data->source->framesize, buffer->frame2);
+    } else if(data->prefetch != NULL) {
+        PREFETCHSLOT* slot = TakePrefetched(data->prefetch, buffer->index);
+        boolean ok = ReadFrameMem(data->codec,
+                                  buffer->frame1,
+                                  slot->ok[0] ? slot->data[0] : NULL,
+                                  slot->size[0],
+                                  buffer->fname,
+                                  params.framewidth,
+                                  params.frameheight)
+                     && ReadFrameMem(data->codec,
+                                     buffer->frame2,
+                                     slot->ok[1] ? slot->data[1] : NULL,
+                                     slot->size[1],
+                                     fname2,
+                                     params.framewidth,
+                                     params.frameheight);
+        ReleasePrefetched(data->prefetch, slot);
+        if(!ok) return (TRUE);
+    } else if(!ReadFrame(data->codec, buffer->frame1, buffer->fname, params.framewidth, params.frameheight)) {
+        if(params.debug)
+            fprintf(stderr, "%s() T%02li - failed to read frame \"%s\"\n", data->progName, data->worker_id, buffer->fname);
+        return (TRUE);
+    } else if(!ReadFrame(data->codec, buffer->frame2, fname2, params.framewidth, params.frameheight)) {
+        if(params.debug)
+            fprintf(stderr, "%s() T%02li - failed to read frame \"%s\"\n", data->progName, data->worker_id, fname2);
+        return (TRUE);
+    }
+    buffer->ok = TRUE;
+
+    return (TRUE);
+}
+
+
+/*
+    Set up the lookup table for the requested format, g_lltable (uv and folded formats), g_gathertable,
+    or g_bilineartable for a gather table with bilinear sampling
+    A valid cache file is mapped directly, otherwise the table is created, saved and then mapped
+    so that concurrent processes using the same table share one copy in the page cache
+    A gather table is resolved from the (u,v) table, which is only generated if it isn't cached either
+*/
+boolean MakeLookupTable(const char* progName) {
+    char tablename[256], legacyname[256];
+    size_t elementsize = TableElementSize(params.tableformat);
+    TABLEFILE uvtable = { NULL, 0, NULL };
+    FILE* fptr;
+
+    if(params.tableformat == TABLE_FOLDED) ntable = FoldedRows() * FoldedColumns();
+    else
+        ntable = params.outheight * params.outwidth * params.antialias * params.antialias;
+    TableFileName(tablename, params.tableformat);
+    if(params.debug) fprintf(stderr, "%s() - Mapping lookup table \"%s\"\n", progName, tablename);
+    if(!MapTable(&g_tablefile, tablename, params.tableformat, elementsize)) {
+        // Get the (u,v) table, cached, legacy headerless file or generate it
+        if(params.tableformat == TABLE_GATHER || params.tableformat == TABLE_PACKED) {
+            TableFileName(legacyname, TABLE_UV);
+            MapTable(&uvtable, legacyname, TABLE_UV, sizeof(LLTABLE));
+        } else if(params.tableformat == TABLE_FOLDED) {
+            if((uvtable.data = malloc(ntable * sizeof(LLTABLE))) == NULL) {
+                fprintf(stderr, "%s() - Failed to malloc lookup table\n", progName);
+                return (FALSE);
+            }
+            if(params.debug) fprintf(stderr, "%s() - Generating folded lookup table\n", progName);
+            ParallelRows(GenerateFoldedTable, uvtable.data, FoldedRows());
+        }
+        if(uvtable.data == NULL) {
+            if((uvtable.data = malloc(ntable * sizeof(LLTABLE))) == NULL) {
+                fprintf(stderr, "%s() - Failed to malloc lookup table\n", progName);
+                return (FALSE);
+            }
+            int n = 0;
+            sprintf(legacyname, "%d_%d_%d_%li.data", whichtemplate, params.outwidth, params.outheight, params.antialias);
+            if(params.tilesize == 0 && params.framescale == 1 && (fptr = fopen(legacyname, "rb")) != NULL) {
+                if(params.debug) fprintf(stderr, "%s() - Reading legacy lookup table \"%s\"\n", progName, legacyname);
+                n = fread(uvtable.data, sizeof(LLTABLE), ntable, fptr);
+                if(n != ntable || fgetc(fptr) != EOF) {
+                    fprintf(stderr, "%s() - Ignoring legacy lookup table \"%s\", wrong size\n", progName, legacyname);
+                    n = 0;
+                }
+                fclose(fptr);
+            }
+            if(n != ntable) {
+                if(params.debug) fprintf(stderr, "%s() - Generating lookup table\n", progName);
+                double starttime = GetRunTime();
+                ParallelRows(GenerateUVTable, uvtable.data, params.outheight);
+                if(params.debug) {
+                    fprintf(stderr,
+                            "%s() - Generated lookup table in %g seconds, %li threads\n",
+                            progName,
+                            GetRunTime() - starttime,
+                            params.threads);
+                }
+            }
+        }
+
+        if(params.tableformat == TABLE_GATHER) {
+            if(params.debug) fprintf(stderr, "%s() - Building gather table\n", progName);
+            if((g_tablefile.data = malloc(ntable * elementsize)) == NULL) {
+                fprintf(stderr, "%s() - Failed to malloc gather table\n", progName);
+                return (FALSE);
+            }
+            CONVERTJOB job = { uvtable.data, g_tablefile.data };
+            ParallelRows(GatherRows, &job, params.outheight);
+            ReleaseTable(&uvtable);
+        } else if(params.tableformat == TABLE_PACKED) {
+            if(params.debug) fprintf(stderr, "%s() - Building packed table\n", progName);
+            if((g_tablefile.data = malloc(ntable * sizeof(PACKEDTABLE))) == NULL) {
+                fprintf(stderr, "%s() - Failed to malloc packed table\n", progName);
+                return (FALSE);
+            }
+            CONVERTJOB job = { uvtable.data, g_tablefile.data };
+            ParallelRows(PackRows, &job, params.outheight);
+            ReleaseTable(&uvtable);
+        } else {
+            g_tablefile = uvtable;
+        }
+
+        // Save and switch over to the shared mapping, keep the private copy if that fails
+        if(params.debug) fprintf(stderr, "%s() - Saving lookup table \"%s\"\n", progName, tablename);
+        if(SaveTable(tablename, params.tableformat, elementsize, g_tablefile.data)) {
+            TABLEFILE mapped = { NULL, 0, NULL };
+            if(MapTable(&mapped, tablename, params.tableformat, elementsize)) {
+                ReleaseTable(&g_tablefile);
+                g_tablefile = mapped;
+            }
+        }
+    }
+
+    if(params.tableformat == TABLE_FOLDED) InitUnfold();
+    if(params.tableformat == TABLE_GATHER && params.sampling == SAMPLING_BILINEAR) g_bilineartable = g_tablefile.data;
+    else if(params.tableformat == TABLE_GATHER)
+        g_gathertable = g_tablefile.data;
+    else if(params.tableformat == TABLE_PACKED)
+        g_packedtable = g_tablefile.data;
+    else
+        g_lltable = g_tablefile.data;
+
+    return (TRUE);
+}
+
+/*
+    Run func over rows 0 ... nrows-1 using params.threads threads
+    Rows are handed out in small chunks so uneven rows balance out,
+    func must only write the part of its output belonging to the rows it is given
+*/
+void ParallelRows(void (*func)(void*, int, int), void* arg, int nrows) {
+    size_t nthreads = MAX(1, MIN(params.threads, (size_t)nrows));
+    pthread_t thread[nthreads];
+    ROWJOB job;
+
+    job.func = func;
+    job.arg = arg;
+    job.nrows = nrows;
+    job.chunk = MAX(1, nrows / (int)(16 * nthreads));
+    job.nextrow = 0;
+    pthread_mutex_init(&job.mutex, NULL);
+
+    // The calling thread works too
+    for(size_t t = 1; t < nthreads; t++) {
+        if(pthread_create(&thread[t], NULL, RowJobWorker, &job) != 0) {
+            nthreads = t;
+            break;
+        }
+    }
+    RowJobWorker(&job);
+    for(size_t t = 1; t < nthreads; t++) pthread_join(thread[t], NULL);
+
+    pthread_mutex_destroy(&job.mutex);
+}
+
+void* RowJobWorker(void* input) {
+    ROWJOB* job = input;
+    int j0, j1;
+
+    for(;;) {
+        pthread_mutex_lock(&job->mutex);
+        j0 = job->nextrow;
+        j1 = MIN(j0 + job->chunk, job->nrows);
+        job->nextrow = j1;
+        pthread_mutex_unlock(&job->mutex);
+        if(j0 >= job->nrows) break;
+        job->func(job->arg, j0, j1);
+    }
+
+    return NULL;
+}
+
+/*
+    Compute the face and (u,v) for every supersample of output rows j0 ... j1-1
+    Each entry only depends on its own position so the result doesn't depend on how rows are shared out,
+    entries are stored in the table order, see TableOffset()
+*/
+void GenerateUVTable(void* arg, int j0, int j1) {
+    LLTABLE* lltable = arg;
+    double x, y, x0, y0, longitude, latitude;
+    double dx = params.antialias * params.outwidth;
+    double dy = params.antialias * params.outheight;
+
+    for(int j = j0; j < j1; j++) {
+        y0 = j / (double)params.outheight;
+        for(int i = 0; i < params.outwidth; i++) {
+            int itable = TableOffset(i, j) * params.antialias2;
+            x0 = i / (double)params.outwidth;
+            for(size_t aj = 0; aj < params.antialias; aj++) {
+                y = y0 + aj / dy; // 0 ... 1
+                for(size_t ai = 0; ai < params.antialias; ai++) {
+                    x = x0 + ai / dx; // 0 ... 1
+                    longitude = x * TWOPI - M_PI; // -pi ... pi
+                    latitude = y * M_PI - M_PI / 2; // -pi/2 ... pi/2
+                    lltable[itable].face = FindFaceUV(longitude, latitude, &(lltable[itable].uv));
+                    itable++;
+                }
+            }
+        }
+    }
+}
+
+/*
+    The equirectangular mapping is symmetric under rotations of 90 degrees in longitude
+    and mirroring in latitude, the folded table only stores the supersamples of one
+    such region, in longitude -pi ... -pi/2 and latitude 0 ... pi/2 inclusive
+    Supersample row k = j*antialias+aj of the output mirrors to row antialias*outheight-k,
+    supersample column m = i*antialias+ai rotates to column m+antialias*outwidth/4
+*/
+int FoldedRows(void) { return (params.antialias * params.outheight / 2 + 1); }
+
+int FoldedColumns(void) { return (params.antialias * params.outwidth / 4); }
+
+void GenerateFoldedTable(void* arg, int kk0, int kk1) {
+    LLTABLE* lltable = arg;
+    double x, y, longitude, latitude;
+    double dx = params.antialias * params.outwidth;
+    double dy = params.antialias * params.outheight;
+    int ncolumns = FoldedColumns();
+    int itable = kk0 * ncolumns;
+
+    for(int kk = kk0; kk < kk1; kk++) {
+        int k = params.antialias * params.outheight / 2 + kk;
+        y = (k / params.antialias) / (double)params.outheight + (k % params.antialias) / dy; // As for GenerateUVTable()
+        latitude = y * M_PI - M_PI / 2;
+        for(int m = 0; m < ncolumns; m++) {
+            x = (m / params.antialias) / (double)params.outwidth + (m % params.antialias) / dx;
+            longitude = x * TWOPI - M_PI;
+            lltable[itable].face = FindFaceUV(longitude, latitude, &(lltable[itable].uv));
+            itable++;
+        }
+    }
+}
+
+/*
+    Work out how face and (u,v) change under the latitude mirror followed by 0 to 3 rotations
+    Under the mirror v becomes 1-v and top and down swap over, under a rotation front goes to right
+    and the top and down (u,v) rotate, the side (u,v) don't change
+*/
+void InitUnfold(void) {
+    for(int mirror = 0; mirror < 2; mirror++) {
+        for(int face = 0; face < 6; face++) {
+            UVTRANSFORM t = { face, FALSE, FALSE, mirror };
+            if(mirror && face == TOP) t.face = DOWN;
+            if(mirror && face == DOWN) t.face = TOP;
+            for(int quadrant = 0; quadrant < 4; quadrant++) {
+                g_unfold[mirror][quadrant][face] = t;
+                boolean flipu = t.flipu;
+                switch(t.face) {
+                case LEFT: t.face = FRONT; break;
+                case FRONT: t.face = RIGHT; break;
+                case RIGHT: t.face = BACK; break;
+                case BACK: t.face = LEFT; break;
+                case TOP: // (u,v) -> (1-v,u)
+                    t.swap = !t.swap;
+                    t.flipu = !t.flipv;
+                    t.flipv = flipu;
+                    break;
+                case DOWN: // (u,v) -> (v,1-u)
+                    t.swap = !t.swap;
+                    t.flipu = t.flipv;
+                    t.flipv = !flipu;
+                    break;
+                }
+            }
+        }
+    }
+}
+
+/*
+    Recover the face and (u,v) of supersample row k, column m from the folded table
+    RemapFolded() does the same with the row and quadrant lookups taken out of the inner loop
+*/
+int UnfoldUV(int k, int m, UV* uv) {
+    int halfrows = params.antialias * params.outheight / 2;
+    int ncolumns = FoldedColumns();
+    int quadrant = m / ncolumns;
+    boolean mirror = k < halfrows;
+    const LLTABLE* entry = &g_lltable[(mirror ? halfrows - k : k - halfrows) * ncolumns + m - quadrant * ncolumns];
+
+    return (UnfoldEntry(entry, &g_unfold[mirror][quadrant][entry->face], uv));
+}
+
+/*
+    Apply a folded table transform to a table entry
+    Points exactly on a cube edge may come out on the neighbouring face to the full table
+*/
+int UnfoldEntry(const LLTABLE* entry, const UVTRANSFORM* t, UV* uv) {
+    // Written to compile to selects rather than branches, the flips vary too often to predict
+    float u = t->swap ? entry->uv.v : entry->uv.u;
+    float v = t->swap ? entry->uv.u : entry->uv.v;
+    u = t->flipu ? 1 - u : u;
+    v = t->flipv ? 1 - v : v;
+
+    // As for FindFaceUV()
+    uv->u = (u < 1) ? u : (float)NEARLYONE;
+    uv->v = (v < 1) ? v : (float)NEARLYONE;
+
+    return (t->face);
+}
+
+/*
+    Lookup table cache file name, depends on the template, output size, antialiasing and format
+    Gather tables also depend on the blend curve, named unless it is the default, and on bilinear sampling,
+    tables in tile order are named with the tile size and those for scaled frames with the scale
+*/
+void TableFileName(char* fname, int format) {
+    char curve[32] = "", sampling[32] = "", tiles[32] = "", scale[32] = "";
+
+    if(format == TABLE_GATHER && params.blendcurve != BLEND_TANH) sprintf(curve, "-%s", blendcurvename[params.blendcurve]);
+    if(format == TABLE_GATHER && params.sampling == SAMPLING_BILINEAR) strcpy(sampling, "-bilinear");
+    if(format != TABLE_FOLDED && params.tilesize > 0) sprintf(tiles, "-t%d", params.tilesize);
+    if(params.framescale > 1) sprintf(scale, "-r%d", params.framescale);
+    sprintf(fname,
+            "%d_%d_%d_%li_%s%s%s%s%s.lut",
+            whichtemplate,
+            params.outwidth,
+            params.outheight,
+            params.antialias,
+            tableformatname[format],
+            curve,
+            sampling,
+            tiles,
+            scale);
+}
+
+/*
+    Position of output pixel (i,j) in the table, in units of antialias2 entries
+    Without tiles the table is in row order, otherwise tiles of tilesize x tilesize pixels follow
+    each other across a band of tiles, and the rows of a tile follow each other within it
+    Tiles on the right and bottom edges are narrower or shorter
+*/
+size_t TableOffset(int i, int j) {
+    int t = params.tilesize;
+
+    if(t <= 0) return ((size_t)j * params.outwidth + i);
+
+    int it = i - i % t, jt = j - j % t;
+    int w = MIN(t, params.outwidth - it), h = MIN(t, params.outheight - jt);
+
+    return ((size_t)jt * params.outwidth + (size_t)it * h + (size_t)(j - jt) * w + (i - it));
+}
+
+size_t TableElementSize(int format) {
+    switch(format) {
+    case TABLE_GATHER: return ((params.sampling == SAMPLING_BILINEAR) ? sizeof(BILINEARTABLE) : sizeof(GATHERTABLE));
+    case TABLE_PACKED: return (sizeof(PACKEDTABLE));
+    default: return (sizeof(LLTABLE));
+    }
+}
+
+/*
+    Describe the current table geometry, the checksum is only computed if the entries are given
+*/
+void FillTableHeader(TABLEHEADER* header, int format, size_t elementsize, const void* data) {
+    memset(header, 0, sizeof(TABLEHEADER));
+    memcpy(header->magic, TABLE_MAGIC, sizeof(header->magic));
+    header->version = TABLE_VERSION;
+    header->byteorder = TABLE_BYTEORDER;
+    header->format = format;
+    header->elementsize = elementsize;
+    header->headersize = TABLE_HEADERSIZE;
+    header->framespecs = template[whichtemplate];
+    header->outwidth = params.outwidth;
+    header->outheight = params.outheight;
+    header->antialias = params.antialias;
+    if(format == TABLE_GATHER) header->blendcurve = params.blendcurve;
+    if(format != TABLE_FOLDED) header->tilesize = params.tilesize;
+    header->n = ntable;
+    if(data != NULL) header->checksum = TableChecksum(data, ntable * elementsize);
+}
+
+/*
+    64 bit FNV-1a over 8 byte words, enough to catch truncated or corrupted tables
+*/
+unsigned long long TableChecksum(const void* data, size_t length) {
+    const unsigned char* p = data;
+    unsigned long long h = 0xcbf29ce484222325ULL, w;
+    size_t i;
+
+    for(i = 0; i + sizeof(w) <= length; i += sizeof(w)) {
+        memcpy(&w, p + i, sizeof(w));
+        h = (h ^ w) * 0x100000001b3ULL;
+    }
+    for(; i < length; i++) h = (h ^ p[i]) * 0x100000001b3ULL;
+
+    return (h);
+}
+
+/*
+    Map a lookup table file read only, checking it matches what we are about to use
+    Return FALSE if it doesn't exist or isn't valid, the caller then builds a new one
+*/
+boolean MapTable(TABLEFILE* table, const char* fname, int format, size_t elementsize) {
+    int fd;
+    struct stat st;
+    TABLEHEADER expect;
+    const TABLEHEADER* header;
+    void* base;
+
+    if((fd = open(fname, O_RDONLY)) < 0) return (FALSE);
+    if(fstat(fd, &st) != 0 || (size_t)st.st_size != TABLE_HEADERSIZE + ntable * elementsize) {
+        fprintf(stderr, "MapTable() - Lookup table \"%s\" has the wrong size, ignored\n", fname);
+        close(fd);
+        return (FALSE);
+    }
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(base == MAP_FAILED) {
+        fprintf(stderr, "MapTable() - Failed to map lookup table \"%s\"\n", fname);
+        return (FALSE);
+    }
+
+    // Everything but the checksum must match exactly
+    header = base;
+    FillTableHeader(&expect, format, elementsize, NULL);
+    expect.checksum = header->checksum;
+    if(memcmp(header, &expect, sizeof(TABLEHEADER)) != 0) {
+        fprintf(stderr, "MapTable() - Lookup table \"%s\" is stale or from another version, ignored\n", fname);
+        munmap(base, st.st_size);
+        return (FALSE);
+    }
+    madvise(base, st.st_size, MADV_WILLNEED);
+    if(TableChecksum((char*)base + TABLE_HEADERSIZE, ntable * elementsize) != header->checksum) {
+        fprintf(stderr, "MapTable() - Lookup table \"%s\" failed the checksum, ignored\n", fname);
+        munmap(base, st.st_size);
+        return (FALSE);
+    }
+
+    table->base = base;
+    table->length = st.st_size;
+    table->data = (char*)base + TABLE_HEADERSIZE;
+
+    return (TRUE);
+}
+
+/*
+    Write a lookup table file
+    Written under a temporary name and renamed so concurrent processes never see a partial table
+*/
+boolean SaveTable(const char* fname, int format, size_t elementsize, const void* data) {
+    char tmpname[300];
+    char header[TABLE_HEADERSIZE] = { 0 };
+    FILE* fptr;
+    boolean ok;
+
+    FillTableHeader((TABLEHEADER*)header, format, elementsize, data);
+    sprintf(tmpname, "%s.%d.tmp", fname, (int)getpid());
+    if((fptr = fopen(tmpname, "wb")) == NULL) {
+        fprintf(stderr, "SaveTable() - Failed to create lookup table \"%s\"\n", tmpname);
+        return (FALSE);
+    }
+    ok = fwrite(header, TABLE_HEADERSIZE, 1, fptr) == 1 && fwrite(data, elementsize, ntable, fptr) == (size_t)ntable;
+    if(fclose(fptr) != 0) ok = FALSE;
+    if(!ok || rename(tmpname, fname) != 0) {
+        fprintf(stderr, "SaveTable() - Failed to write lookup table \"%s\"\n", fname);
+        unlink(tmpname);
+        return (FALSE);
+    }
+
+    return (TRUE);
+}
+
+/*
+    Unmap or free a table
+*/
+void ReleaseTable(TABLEFILE* table) {
+    if(table->base != NULL) munmap(table->base, table->length);
+    else
+        free(table->data);
+    table->base = NULL;
+    table->length = 0;
+    table->data = NULL;
+}
+
+/*
+    Form pixels i0 ... i1-1 of row j of the spherical image using the (u,v) lookup table
+*/
+void RemapUVSpan(BITMAP4* frame1, BITMAP4* frame2, BITMAP3* spherical, int j, int i0, int i1) {
+    const LLTABLE* entry = &g_lltable[TableOffset(i0, j) * params.antialias2];
+
+    for(int i = i0; i < i1; i++) {
+        COLOUR16 csum = { 0, 0, 0 }; // Supersampling antialising sum
+
+        // Antialiasing loops
+        for(size_t a = 0; a < params.antialias2; a++, entry++) {
+            // Sum over the supersampling set
+            BITMAP4 c = GetColour(entry->face, entry->uv, frame1, frame2);
+            csum.r += c.r;
+            csum.g += c.g;
+            csum.b += c.b;
+        }
+
+        // Finally update the spherical image
+        int index = j * params.outwidth + i;
+        spherical[index].r = csum.r / params.antialias2;
+        spherical[index].g = csum.g / params.antialias2;
+        spherical[index].b = csum.b / params.antialias2;
+    }
+}
+
+/*
+    Form pixels i0 ... i1-1 of row j of the spherical image using the packed lookup table
+*/
+void RemapPackedSpan(BITMAP4* frame1, BITMAP4* frame2, BITMAP3* spherical, int j, int i0, int i1) {
+    const PACKEDTABLE* entry = &g_packedtable[TableOffset(i0, j) * params.antialias2];
+    UV uv;
+
+    for(int i = i0; i < i1; i++) {
+        COLOUR16 csum = { 0, 0, 0 }; // Supersampling antialising sum
+
+        for(size_t a = 0; a < params.antialias2; a++, entry++) {
+            int face = UnpackUV(*entry, &uv);
+            BITMAP4 c = GetColour(face, uv, frame1, frame2);
+            csum.r += c.r;
+            csum.g += c.g;
+            csum.b += c.b;
+        }
+
+        int index = j * params.outwidth + i;
+        spherical[index].r = csum.r / params.antialias2;
+        spherical[index].g = csum.g / params.antialias2;
+        spherical[index].b = csum.b / params.antialias2;
+    }
+}
+
+/*
+    Form rows j0 ... j1-1 of the spherical image using the folded (u,v) lookup table
+*/
+void RemapFolded(BITMAP4* frame1, BITMAP4* frame2, BITMAP3* spherical, int j0, int j1) {
+    int halfrows = params.antialias * params.outheight / 2;
+    int ncolumns = FoldedColumns();
+    int quarterwidth = params.outwidth / 4;
+    const LLTABLE* row[params.antialias]; // Folded table row for each supersample row of this output row
+    boolean mirror[params.antialias];
+    UV uv;
+
+    for(int j = j0; j < j1; j++) {
+        for(size_t aj = 0; aj < params.antialias; aj++) {
+            int k = j * params.antialias + aj;
+            mirror[aj] = k < halfrows;
+            row[aj] = &g_lltable[(mirror[aj] ? halfrows - k : k - halfrows) * ncolumns];
+        }
+        for(int i = 0; i < params.outwidth; i++) {
+            COLOUR16 csum = { 0, 0, 0 }; // Supersampling antialising sum
+            int quadrant = i / quarterwidth;
+            int m0 = (i - quadrant * quarterwidth) * params.antialias;
+
+            for(size_t aj = 0; aj < params.antialias; aj++) {
+                const UVTRANSFORM* transform = g_unfold[mirror[aj]][quadrant];
+                for(size_t ai = 0; ai < params.antialias; ai++) {
+                    const LLTABLE* entry = &row[aj][m0 + ai];
+                    int face = UnfoldEntry(entry, &transform[entry->face], &uv);
+                    BITMAP4 c = GetColour(face, uv, frame1, frame2);
+                    csum.r += c.r;
+                    csum.g += c.g;
+                    csum.b += c.b;
+                }
+            }
+
+            int index = j * params.outwidth + i;
+            spherical[index].r = csum.r / params.antialias2;
+            spherical[index].g = csum.g / params.antialias2;
+            spherical[index].b = csum.b / params.antialias2;
+        }
+    }
+}
+
+/*
+    Form pixels i0 ... i1-1 of row j of the spherical image using the pre-resolved gather table
+    No geometry is evaluated here, each sample is one or two pixel fetches and an integer blend
+    This is the scalar reference for the vector versions
+*/
+void RemapGatherSpan(const BITMAP4* frame1, const BITMAP4* frame2, BITMAP3* spherical, int j, int i0, int i1) {
+    const GATHERTABLE* g = &g_gathertable[TableOffset(i0, j) * params.antialias2];
+
+    for(int i = i0; i < i1; i++) {
+        COLOUR16 csum = { 0, 0, 0 }; // Supersampling antialising sum
+
+        for(size_t a = 0; a < params.antialias2; a++, g++) {
+            const BITMAP4* src = (g->index & GATHER_FRAME2) ? frame2 : frame1;
+            const BITMAP4* c1 = &src[g->index & ~GATHER_FRAME2];
+            const BITMAP4* c2 = c1 + g->dx;
+            unsigned int w2 = g->weight, w1 = 256 - w2;
+            csum.r += (c1->r * w1 + c2->r * w2) >> 8;
+            csum.g += (c1->g * w1 + c2->g * w2) >> 8;
+            csum.b += (c1->b * w1 + c2->b * w2) >> 8;
+        }
+
+        int index = j * params.outwidth + i;
+        spherical[index].r = csum.r / params.antialias2;
+        spherical[index].g = csum.g / params.antialias2;
+        spherical[index].b = csum.b / params.antialias2;
+    }
+}
+
+/*
+    Form pixels i0 ... i1-1 of row j of the spherical image using the bilinear gather table, -s bilinear
+    Each sample interpolates 2x2 frame pixels, or two sets of them blended across a seam
+    This is the scalar reference for the vector version
+*/
+void RemapBilinearSpan(const BITMAP4* frame1, const BITMAP4* frame2, BITMAP3* spherical, int j, int i0, int i1) {
+    const BILINEARTABLE* b = &g_bilineartable[TableOffset(i0, j) * params.antialias2];
+
+    for(int i = i0; i < i1; i++) {
+        COLOUR16 csum = { 0, 0, 0 }; // Supersampling antialising sum
+
+        for(size_t a = 0; a < params.antialias2; a++, b++) {
+            const BITMAP4* src = (b->index & GATHER_FRAME2) ? frame2 : frame1;
+            const BITMAP4* p = &src[b->index & ~GATHER_FRAME2];
+            BITMAP4 c1 = BilinearBlend(p, b->wx1, b->wy), c2 = c1;
+            if(b->weight > 0) c2 = BilinearBlend(p + b->dx, b->wx2, b->wy);
+            unsigned int w2 = b->weight, w1 = 256 - w2;
+            csum.r += (c1.r * w1 + c2.r * w2) >> 8;
+            csum.g += (c1.g * w1 + c2.g * w2) >> 8;
+            csum.b += (c1.b * w1 + c2.b * w2) >> 8;
+        }
+
+        int index = j * params.outwidth + i;
+        spherical[index].r = csum.r / params.antialias2;
+        spherical[index].g = csum.g / params.antialias2;
+        spherical[index].b = csum.b / params.antialias2;
+    }
+}
+
+#ifdef REMAP_X86
+/*
+    AVX2 version of RemapGatherSpan(), 8 output pixels at a time, one per lane
+    The table entries of the 8 pixels and then the frame pixels are fetched with gathers,
+    the supersamples are summed in registers and the 8 pixels stored together
+    Blends use the same integer arithmetic as RemapGatherSpan() so the results are identical
+*/
+__attribute__((target("avx2"))) void
+RemapGatherAVX2Span(const BITMAP4* frame1, const BITMAP4* frame2, BITMAP3* spherical, int j, int i0, int i1) {
+    const int a2 = params.antialias2;
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i ones = _mm256_set1_epi32(-1);
+    const __m256i stride = _mm256_setr_epi32(0, 2 * a2, 4 * a2, 6 * a2, 8 * a2, 10 * a2, 12 * a2, 14 * a2);
+    const __m256i lowbyte = _mm256_set1_epi32(0x000000FF);
+    const __m256i thirdbyte = _mm256_set1_epi32(0x00FF0000);
+    const __m256i pixelmask = _mm256_set1_epi32(~GATHER_FRAME2);
+    const __m256i full = _mm256_set1_epi32(256);
+    const __m256i pack = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+                                          0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    const __m256 half = _mm256_set1_ps(0.5);
+    const __m256 scale = _mm256_set1_ps(1.0 / a2);
+    const GATHERTABLE* entry = &g_gathertable[TableOffset(i0, j) * a2];
+    int i;
+
+    for(i = i0; i + 8 <= i1; i += 8, entry += 8 * a2) {
+        const int* t = (const int*)entry;
+        __m256i rsum = zero, gsum = zero, bsum = zero;
+
+        for(int a = 0; a < a2; a++, t += sizeof(GATHERTABLE) / sizeof(int)) {
+            // Table entry, the frame select bit doubles as the gather mask
+            __m256i index = _mm256_i32gather_epi32(t, stride, 4);
+            __m256i dxw = _mm256_i32gather_epi32(t + 1, stride, 4);
+            __m256i pixel = _mm256_and_si256(index, pixelmask);
+            __m256i inframe1 = _mm256_xor_si256(index, ones);
+            __m256i weight = _mm256_srli_epi32(dxw, 16);
+
+            __m256i c1 = _mm256_mask_i32gather_epi32(zero, (const int*)frame1, pixel, inframe1, 4);
+            c1 = _mm256_mask_i32gather_epi32(c1, (const int*)frame2, pixel, index, 4);
+            __m256i c2 = c1;
+            if(!_mm256_testz_si256(weight, weight)) {
+                pixel = _mm256_add_epi32(pixel, _mm256_srai_epi32(_mm256_slli_epi32(dxw, 16), 16));
+                c2 = _mm256_mask_i32gather_epi32(zero, (const int*)frame1, pixel, inframe1, 4);
+                c2 = _mm256_mask_i32gather_epi32(c2, (const int*)frame2, pixel, index, 4);
+            }
+
+            // 16 bit pairs (channel of c1, channel of c2) times (256 - weight, weight), summed by madd
+            __m256i w = _mm256_or_si256(_mm256_sub_epi32(full, weight), _mm256_slli_epi32(weight, 16));
+            __m256i r = _mm256_or_si256(_mm256_and_si256(c1, lowbyte),
+                                        _mm256_slli_epi32(_mm256_and_si256(c2, lowbyte), 16));
+            __m256i g = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi32(c1, 8), lowbyte),
+                                        _mm256_and_si256(_mm256_slli_epi32(c2, 8), thirdbyte));
+            __m256i b = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi32(c1, 16), lowbyte),
+                                        _mm256_and_si256(c2, thirdbyte));
+            rsum = _mm256_add_epi32(rsum, _mm256_srli_epi32(_mm256_madd_epi16(r, w), 8));
+            gsum = _mm256_add_epi32(gsum, _mm256_srli_epi32(_mm256_madd_epi16(g, w), 8));
+            bsum = _mm256_add_epi32(bsum, _mm256_srli_epi32(_mm256_madd_epi16(b, w), 8));
+        }
+
+        // Integer average, the half keeps exact multiples from rounding down
+        rsum = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_add_ps(_mm256_cvtepi32_ps(rsum), half), scale));
+        gsum = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_add_ps(_mm256_cvtepi32_ps(gsum), half), scale));
+        bsum = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_add_ps(_mm256_cvtepi32_ps(bsum), half), scale));
+        __m256i c = _mm256_or_si256(_mm256_or_si256(rsum, _mm256_slli_epi32(gsum, 8)), _mm256_slli_epi32(bsum, 16));
+
+        // Packed to RGB, 12 bytes in each half, stored as 16 + 8 + 4 bytes so nothing past the 8 pixels is written
+        c = _mm256_shuffle_epi8(c, pack);
+        unsigned char* out = (unsigned char*)&spherical[j * params.outwidth + i];
+        __m128i hi = _mm256_extracti128_si256(c, 1);
+        int last = _mm_cvtsi128_si32(_mm_srli_si128(hi, 8));
+        _mm_storeu_si128((__m128i*)out, _mm256_castsi256_si128(c));
+        _mm_storel_epi64((__m128i*)(out + 12), hi);
+        memcpy(out + 20, &last, 4);
+    }
+    RemapGatherSpan(frame1, frame2, spherical, j, i, i1);
+}
+
+/*
+    Bilinear interpolation of 8 samples, one per lane, the 2x2 pixels from pixel in the frame index selects,
+    wx and wy are the weights of the right column and the lower row, 0 ... 256
+    The channels are returned packed as in a pixel, with the same arithmetic as BilinearBlend()
+*/
+__attribute__((target("avx2"))) __m256i
+BilinearAVX2(const BITMAP4* frame1, const BITMAP4* frame2, __m256i pixel, __m256i index, __m256i wx, __m256i wy) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i lowbyte = _mm256_set1_epi32(0x000000FF);
+    const __m256i full = _mm256_set1_epi32(256);
+    const __m256i inframe1 = _mm256_xor_si256(index, _mm256_set1_epi32(-1));
+    const int offset[4] = { 0, 1, template[whichtemplate].width, template[whichtemplate].width + 1 };
+    __m256i p[4], c = zero;
+
+    for(int k = 0; k < 4; k++) {
+        __m256i at = _mm256_add_epi32(pixel, _mm256_set1_epi32(offset[k]));
+        p[k] = _mm256_mask_i32gather_epi32(zero, (const int*)frame1, at, inframe1, 4);
+        p[k] = _mm256_mask_i32gather_epi32(p[k], (const int*)frame2, at, index, 4);
+    }
+
+    // 16 bit pairs (left, right) times (256 - wx, wx) summed by madd, then the two rows in 32 bits
+    __m256i wh = _mm256_or_si256(_mm256_sub_epi32(full, wx), _mm256_slli_epi32(wx, 16));
+    __m256i wv = _mm256_sub_epi32(full, wy);
+    for(int shift = 0; shift < 24; shift += 8) {
+        __m128i count = _mm_cvtsi32_si128(shift);
+        __m256i q[4];
+        for(int k = 0; k < 4; k++) q[k] = _mm256_and_si256(_mm256_srl_epi32(p[k], count), lowbyte);
+        __m256i top = _mm256_madd_epi16(_mm256_or_si256(q[0], _mm256_slli_epi32(q[1], 16)), wh);
+        __m256i bottom = _mm256_madd_epi16(_mm256_or_si256(q[2], _mm256_slli_epi32(q[3], 16)), wh);
+        top = _mm256_add_epi32(_mm256_mullo_epi32(top, wv), _mm256_mullo_epi32(bottom, wy));
+        c = _mm256_or_si256(c, _mm256_sll_epi32(_mm256_srli_epi32(top, 16), count));
+    }
+
+    return (c);
+}
+
+/*
+    AVX2 version of RemapBilinearSpan(), 8 output pixels at a time, one per lane
+    The pixels are interpolated by BilinearAVX2(), the seam blend and the sums are as in RemapGatherAVX2Span()
+*/
+__attribute__((target("avx2"))) void
+RemapBilinearAVX2Span(const BITMAP4* frame1, const BITMAP4* frame2, BITMAP3* spherical, int j, int i0, int i1) {
+    const int a2 = params.antialias2;
+    const int n = sizeof(BILINEARTABLE) / sizeof(int), e = n * a2;
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i stride = _mm256_setr_epi32(0, e, 2 * e, 3 * e, 4 * e, 5 * e, 6 * e, 7 * e);
+    const __m256i lowbyte = _mm256_set1_epi32(0x000000FF);
+    const __m256i thirdbyte = _mm256_set1_epi32(0x00FF0000);
+    const __m256i lowword = _mm256_set1_epi32(0x0000FFFF);
+    const __m256i pixelmask = _mm256_set1_epi32(~GATHER_FRAME2);
+    const __m256i full = _mm256_set1_epi32(256);
+    const __m256i pack = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+                                          0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    const __m256 half = _mm256_set1_ps(0.5);
+    const __m256 scale = _mm256_set1_ps(1.0 / a2);
+    const BILINEARTABLE* entry = &g_bilineartable[TableOffset(i0, j) * a2];
+    int i;
+
+    for(i = i0; i + 8 <= i1; i += 8, entry += 8 * a2) {
+        const int* t = (const int*)entry;
+        __m256i rsum = zero, gsum = zero, bsum = zero;
+
+        for(int a = 0; a < a2; a++, t += n) {
+            // Table entry, the frame select bit doubles as the gather mask
+            __m256i index = _mm256_i32gather_epi32(t, stride, 4);
+            __m256i dxw = _mm256_i32gather_epi32(t + 1, stride, 4);
+            __m256i wx = _mm256_i32gather_epi32(t + 2, stride, 4);
+            __m256i wy = _mm256_and_si256(_mm256_i32gather_epi32(t + 3, stride, 4), lowword);
+            __m256i pixel = _mm256_and_si256(index, pixelmask);
+            __m256i weight = _mm256_srli_epi32(dxw, 16);
+
+            __m256i c1 = BilinearAVX2(frame1, frame2, pixel, index, _mm256_and_si256(wx, lowword), wy);
+            __m256i c2 = c1;
+            if(!_mm256_testz_si256(weight, weight)) {
+                pixel = _mm256_add_epi32(pixel, _mm256_srai_epi32(_mm256_slli_epi32(dxw, 16), 16));
+                c2 = BilinearAVX2(frame1, frame2, pixel, index, _mm256_srli_epi32(wx, 16), wy);
+            }
+
+            // 16 bit pairs (channel of c1, channel of c2) times (256 - weight, weight), summed by madd
+            __m256i w = _mm256_or_si256(_mm256_sub_epi32(full, weight), _mm256_slli_epi32(weight, 16));
+            __m256i r = _mm256_or_si256(_mm256_and_si256(c1, lowbyte),
+                                        _mm256_slli_epi32(_mm256_and_si256(c2, lowbyte), 16));
+            __m256i g = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi32(c1, 8), lowbyte),
+                                        _mm256_and_si256(_mm256_slli_epi32(c2, 8), thirdbyte));
+            __m256i b = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi32(c1, 16), lowbyte),
+                                        _mm256_and_si256(c2, thirdbyte));
+            rsum = _mm256_add_epi32(rsum, _mm256_srli_epi32(_mm256_madd_epi16(r, w), 8));
+            gsum = _mm256_add_epi32(gsum, _mm256_srli_epi32(_mm256_madd_epi16(g, w), 8));
+            bsum = _mm256_add_epi32(bsum, _mm256_srli_epi32(_mm256_madd_epi16(b, w), 8));
+        }
+
+        rsum = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_add_ps(_mm256_cvtepi32_ps(rsum), half), scale));
+        gsum = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_add_ps(_mm256_cvtepi32_ps(gsum), half), scale));
+        bsum = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_add_ps(_mm256_cvtepi32_ps(bsum), half), scale));
+        __m256i c = _mm256_or_si256(_mm256_or_si256(rsum, _mm256_slli_epi32(gsum, 8)), _mm256_slli_epi32(bsum, 16));
+
+        c = _mm256_shuffle_epi8(c, pack);
+        unsigned char* out = (unsigned char*)&spherical[j * params.outwidth + i];
+        __m128i hi = _mm256_extracti128_si256(c, 1);
+        int last = _mm_cvtsi128_si32(_mm_srli_si128(hi, 8));
+        _mm_storeu_si128((__m128i*)out, _mm256_castsi256_si128(c));
+        _mm_storel_epi64((__m128i*)(out + 12), hi);
+        memcpy(out + 20, &last, 4);
+    }
+    RemapBilinearSpan(frame1, frame2, spherical, j, i, i1);
+}
+#endif
+
+/*
+    Choose the fastest gather kernel the CPU supports, unless the scalar one is asked for,
+    the RGB to YUV conversion for streamed output follows the same choice
+*/
+void SelectRemapKernel(const char* progName) {
+    boolean bilinear = (params.sampling == SAMPLING_BILINEAR);
+
+    RemapGatherKernel = bilinear ? RemapBilinearSpan : RemapGatherSpan;
+#ifdef REMAP_X86
+    if(params.kernel != KERNEL_SCALAR && __builtin_cpu_supports("avx2")) {
+        RemapGatherKernel = bilinear ? RemapBilinearAVX2Span : RemapGatherAVX2Span;
+        RGBToYUV444Kernel = RGBToYUV444AVX2Span;
+        RGBToYUV420Kernel = RGBToYUV420AVX2Span;
+    }
+#endif
+    if(params.debug) {
+        fprintf(stderr,
+                "%s() - Using the %s %s gather kernel\n",
+                progName,
+                (RemapGatherKernel == RemapGatherSpan || RemapGatherKernel == RemapBilinearSpan) ? "scalar" : "AVX2",
+                samplingname[params.sampling]);
+    }
+}
+
+/*
+    Form rows j0 ... j1-1 of the spherical image with the lookup table in use
+    Row by row, or tile by tile along each band of tiles, in the order of the table
+    With tiles j0 must be at the start of a band of tiles
+*/
+void RemapFrame(BITMAP4* frame1, BITMAP4* frame2, BITMAP3* spherical, int j0, int j1) {
+    int tilewidth = params.outwidth, tileheight = 1;
+
+    if(params.tableformat == TABLE_FOLDED) {
+        RemapFolded(frame1, frame2, spherical, j0, j1);
+        return;
+    }
+    if(params.tilesize > 0) {
+        tilewidth = params.tilesize;
+        tileheight = params.tilesize;
+    }
+    for(int jt = j0; jt < j1; jt += tileheight) {
+        for(int i0 = 0; i0 < params.outwidth; i0 += tilewidth) {
+            int i1 = MIN(i0 + tilewidth, params.outwidth);
+            for(int j = jt; j < MIN(jt + tileheight, j1); j++) {
+                switch(params.tableformat) {
+                case TABLE_GATHER: RemapGatherKernel(frame1, frame2, spherical, j, i0, i1); break;
+                case TABLE_PACKED: RemapPackedSpan(frame1, frame2, spherical, j, i0, i1); break;
+                default: RemapUVSpan(frame1, frame2, spherical, j, i0, i1); break;
+                }
+            }
+        }
+    }
+}
+
+/*
+    Time forming a frame params.benchmark times with all threads sharing it, return the seconds per frame
+    The helpers have no frames of their own, they form bands until the scheduler has no frame active
+*/
+double TimeRemapShared(const char* progName, BITMAP4* frame1, BITMAP4* frame2, BITMAP3* spherical, size_t* nthreads) {
+    SCHEDULER scheduler;
+    THREAD_DATA helper[params.threads];
+    pthread_t thread[params.threads];
+    size_t t;
+
+    InitScheduler(&scheduler, NULL, 0);
+    scheduler.nactive = 1;
+    for(t = 1; t < params.threads; t++) {
+        helper[t].worker_id = t;
+        helper[t].scheduler = &scheduler;
+        helper[t].pipeline = NULL;
+#ifdef JOURNALING_ENABLED
+        helper[t].journal = NULL;
+#endif
+        helper[t].progName = progName;
+        if(pthread_create(&thread[t], NULL, worker_function, &helper[t]) != 0) break;
+    }
+    *nthreads = t;
+
+    double starttime = GetRunTime();
+    for(int n = 0; n < params.benchmark; n++) RemapShared(&scheduler, frame1, frame2, spherical);
+    double seconds = (GetRunTime() - starttime) / params.benchmark;
+
+    pthread_mutex_lock(&scheduler.mutex);
+    scheduler.nactive = 0;
+    pthread_cond_broadcast(&scheduler.cond);
+    pthread_mutex_unlock(&scheduler.mutex);
+    for(t = 1; t < *nthreads; t++) pthread_join(thread[t], NULL);
+    DestroyScheduler(&scheduler);
+
+    return (seconds);
+}
+
+/*
+    Time forming the first frame of the sequence repeatedly, no output is written
+    The first frame is the first found in both tracks, or n_start when frames are not listed
+    All threads work on the frame together, as they do for a single frame,
+    when a vector kernel is in use the result is compared with the scalar kernel,
+    the quality is reported as the PSNR against nearest pixel 4x4 supersampling
+*/
+boolean Benchmark(const char* progName, const char* last_argument, size_t nframe) {
+    char fname1[256], fname2[256];
+    BITMAP4 *frame1, *frame2;
+    BITMAP3 *spherical, *reference;
+    CODEC* codec = Create_Codec();
+    boolean ok = FALSE;
+
+    frame1 = Create_Bitmap(params.framewidth, params.frameheight);
+    frame2 = Create_Bitmap(params.framewidth, params.frameheight);
+    spherical = Create_Bitmap3(params.outwidth, params.outheight);
+    reference = Create_Bitmap3(params.outwidth, params.outheight);
+    if(frame1 == NULL || frame2 == NULL || spherical == NULL || reference == NULL || codec == NULL) {
+        fprintf(stderr, "%s() - Failed to malloc memory for the images\n", progName);
+        goto done;
+    }
+    set_frame_filename_from_template(fname1, fname2, nframe, last_argument);
+    if(!ReadFrame(codec, frame1, fname1, params.framewidth, params.frameheight)
+       || !ReadFrame(codec, frame2, fname2, params.framewidth, params.frameheight))
+        goto done;
+
+    BITMAP3 black = { 0, 0, 0 };
+    Erase_Bitmap3(spherical, params.outwidth, params.outheight, black);
+    Erase_Bitmap3(reference, params.outwidth, params.outheight, black);
+    RemapFrame(frame1, frame2, spherical, 0, params.outheight); // Warm up
+
+    char tiles[64] = "rows";
+    if(params.tilesize > 0) sprintf(tiles, "%dx%d tiles", params.tilesize, params.tilesize);
+    size_t nthreads;
+    double seconds = TimeRemapShared(progName, frame1, frame2, spherical, &nthreads);
+
+    fprintf(stderr,
+            "%s() - %s table, %dx%d, antialias %li, %s, %li threads: %.2f ms per frame, %.1f Msamples/s\n",
+            progName,
+            tableformatname[params.tableformat],
+            params.outwidth,
+            params.outheight,
+            params.antialias,
+            tiles,
+            nthreads,
+            1000 * seconds,
+            params.outwidth * params.outheight * params.antialias2 / seconds / 1e6);
+
+    void (*scalar)(const BITMAP4*, const BITMAP4*, BITMAP3*, int, int, int) =
+    (params.sampling == SAMPLING_BILINEAR) ? RemapBilinearSpan : RemapGatherSpan;
+    if(params.tableformat == TABLE_GATHER && RemapGatherKernel != scalar) {
+        int maxdiff = 0;
+        long ndiff = 0;
+        void (*kernel)(const BITMAP4*, const BITMAP4*, BITMAP3*, int, int, int) = RemapGatherKernel;
+        RemapGatherKernel = scalar;
+        RemapFrame(frame1, frame2, reference, 0, params.outheight);
+        RemapGatherKernel = kernel;
+        for(int k = 0; k < params.outwidth * params.outheight; k++) {
+            int d = MAX(MAX(ABS(spherical[k].r - reference[k].r), ABS(spherical[k].g - reference[k].g)),
+                        ABS(spherical[k].b - reference[k].b));
+            if(d > 0) ndiff++;
+            maxdiff = MAX(maxdiff, d);
+        }
+        fprintf(stderr, "%s() - Against the scalar kernel: %ld pixels differ, by at most %d\n", progName, ndiff, maxdiff);
+    }
+
+    if(params.debug) fprintf(stderr, "%s() - Forming the 4x4 supersampled reference\n", progName);
+    REFERENCEJOB job = { frame1, frame2, reference };
+    ParallelRows(ReferenceRows, &job, params.outheight);
+    fprintf(stderr,
+            "%s() - %s sampling, antialias %li: PSNR %.2f dB against 4x4 supersampling\n",
+            progName,
+            samplingname[params.sampling],
+            params.antialias,
+            ImagePSNR(spherical, reference, params.outwidth * params.outheight));
+    ok = TRUE;
+
+done:
+    Destroy_Bitmap(frame1);
+    Destroy_Bitmap(frame2);
+    Destroy_Bitmap3(spherical);
+    Destroy_Bitmap3(reference);
+    Destroy_Codec(codec);
+    return (ok);
+}
+
+/*
+    Form rows j0 ... j1-1 with nearest pixel 4x4 supersampling straight from the geometry,
+    the quality reference for the sampling modes
+*/
+void ReferenceRows(void* arg, int j0, int j1) {
+    REFERENCEJOB* job = arg;
+    UV uv;
+
+    for(int j = j0; j < j1; j++) {
+        for(int i = 0; i < params.outwidth; i++) {
+            COLOUR16 csum = { 0, 0, 0 };
+            for(int aj = 0; aj < 4; aj++) {
+                double latitude = (j + aj / 4.0) / params.outheight * M_PI - M_PI / 2;
+                for(int ai = 0; ai < 4; ai++) {
+                    double longitude = (i + ai / 4.0) / params.outwidth * TWOPI - M_PI;
+                    int face = FindFaceUV(longitude, latitude, &uv);
+                    BITMAP4 c = GetColourNearest(face, uv, job->frame1, job->frame2);
+                    csum.r += c.r;
+                    csum.g += c.g;
+                    csum.b += c.b;
+                }
+            }
+            int index = j * params.outwidth + i;
+            job->spherical[index].r = csum.r / 16;
+            job->spherical[index].g = csum.g / 16;
+            job->spherical[index].b = csum.b / 16;
+        }
+    }
+}
+
+/*
+    Peak signal to noise ratio in dB between two images of n pixels, over the colour channels
+*/
+double ImagePSNR(const BITMAP3* image1, const BITMAP3* image2, long n) {
+    double sum = 0;
+
+    for(long k = 0; k < n; k++) {
+        double dr = image1[k].r - image2[k].r;
+        double dg = image1[k].g - image2[k].g;
+        double db = image1[k].b - image2[k].b;
+        sum += dr * dr + dg * dg + db * db;
+    }
+    if(sum <= 0) return (INFINITY);
+
+    return (10 * log10(255.0 * 255.0 * 3 * n / sum));
+}
+
+/*
+    Convert the (u,v) lookup table into the gather table
+    Seam blend factors are passed through the blend curve here and quantised to 1/256
+*/
+void BuildGatherTable(const LLTABLE* lltable, GATHERTABLE* gathertable, int k0, int k1) {
+    SAMPLE s;
+
+    for(int k = k0; k < k1; k++) {
+        ResolveUV(lltable[k].face, lltable[k].uv, &s);
+        gathertable[k].index = s.index1;
+        if(s.frame == 2) gathertable[k].index |= GATHER_FRAME2;
+        if(s.alpha < 0) {
+            gathertable[k].dx = 0;
+            gathertable[k].weight = 0;
+        } else {
+            gathertable[k].dx = s.index2 - s.index1;
+            gathertable[k].weight = BlendWeight(s.alpha);
+        }
+    }
+}
+
+/*
+    Convert the (u,v) lookup table into the bilinear gather table, -s bilinear
+    The 2x2 pixels of each half of a seam blend are those BilinearPixel() interpolates
+*/
+void BuildBilinearTable(const LLTABLE* lltable, BILINEARTABLE* bilineartable, int k0, int k1) {
+    SAMPLE s;
+    int wx, wy;
+
+    for(int k = k0; k < k1; k++) {
+        BILINEARTABLE* b = &bilineartable[k];
+        ResolveUV(lltable[k].face, lltable[k].uv, &s);
+        b->index = BilinearIndex(lltable[k].face, s.x1, s.y, &wx, &wy);
+        b->wx1 = wx;
+        b->wx2 = wx;
+        b->wy = wy;
+        b->pad = 0;
+        b->dx = 0;
+        b->weight = 0;
+        if(s.alpha >= 0) {
+            b->dx = BilinearIndex(lltable[k].face, s.x2, s.y, &wx, &wy) - (int)b->index;
+            b->wx2 = wx;
+            b->weight = BlendWeight(s.alpha);
+        }
+        if(s.frame == 2) b->index |= GATHER_FRAME2;
+    }
+}
+
+void GatherRows(void* arg, int j0, int j1) {
+    CONVERTJOB* job = arg;
+    int rowsize = params.outwidth * params.antialias2;
+
+    if(params.sampling == SAMPLING_BILINEAR) BuildBilinearTable(job->lltable, job->table, j0 * rowsize, j1 * rowsize);
+    else
+        BuildGatherTable(job->lltable, job->table, j0 * rowsize, j1 * rowsize);
+}
+
+/*
+    Convert rows of the (u,v) table to the packed format
+*/
+void PackRows(void* arg, int j0, int j1) {
+    CONVERTJOB* job = arg;
+    PACKEDTABLE* packedtable = job->table;
+    int rowsize = params.outwidth * params.antialias2;
+
+    for(int k = j0 * rowsize; k < j1 * rowsize; k++) packedtable[k] = PackUV(job->lltable[k].face, job->lltable[k].uv);
+}
+
+/*
+    Quantise (u,v) 0 ... 1 to the nearest fixed point step, the face goes in the top bits
+    Steps are 1/32768 in u and 1/16384 in v, an order of magnitude finer than a pixel for the known templates
+*/
+PACKEDTABLE PackUV(int face, UV uv) {
+    unsigned int u = MIN(lround(uv.u * (1 << PACKED_UBITS)), (1 << PACKED_UBITS) - 1);
+    unsigned int v = MIN(lround(uv.v * (1 << PACKED_VBITS)), (1 << PACKED_VBITS) - 1);
+
+    return (((unsigned int)face << (PACKED_UBITS + PACKED_VBITS)) | (v << PACKED_UBITS) | u);
+}
+
+int UnpackUV(PACKEDTABLE entry, UV* uv) {
+    uv->u = (entry & ((1 << PACKED_UBITS) - 1)) * (1.0f / (1 << PACKED_UBITS));
+    uv->v = ((entry >> PACKED_UBITS) & ((1 << PACKED_VBITS) - 1)) * (1.0f / (1 << PACKED_VBITS));
+
+    return (entry >> (PACKED_UBITS + PACKED_VBITS));
+}
+
+/*
+    Compare the table in use with the full precision (u,v) table
+    Reports how many samples end up on different frame pixels and, for the formats storing (u,v),
+    the largest (u,v) error measured in pixels of a face
+*/
+boolean ValidateTable(const char* progName) {
+    char fname[256];
+    TABLEFILE reference = { NULL, 0, NULL };
+    int nsaved = ntable;
+    long nsamples = 0, nsame = 0, nface = 0;
+    double maxerror = 0;
+    int face;
+    SAMPLE s0, s1;
+    UV uv;
+
+    if(params.tableformat == TABLE_UV) {
+        fprintf(stderr, "%s() - The (u,v) table is the reference, nothing to validate\n", progName);
+        return (TRUE);
+    }
+
+    // The reference is always the full table
+    ntable = params.outheight * params.outwidth * params.antialias2;
+    TableFileName(fname, TABLE_UV);
+    if(!MapTable(&reference, fname, TABLE_UV, sizeof(LLTABLE))) {
+        if((reference.data = malloc(ntable * sizeof(LLTABLE))) == NULL) {
+            fprintf(stderr, "%s() - Failed to malloc reference table\n", progName);
+            ntable = nsaved;
+            return (FALSE);
+        }
+        ParallelRows(GenerateUVTable, reference.data, params.outheight);
+    }
+    ntable = nsaved;
+
+    const LLTABLE* lltable = reference.data;
+    int itable = 0;
+    for(int j = 0; j < params.outheight; j++) {
+        for(int i = 0; i < params.outwidth; i++) {
+            for(size_t aj = 0; aj < params.antialias; aj++) {
+                for(size_t ai = 0; ai < params.antialias; ai++, itable++) {
+                    ResolveUV(lltable[itable].face, lltable[itable].uv, &s0);
+                    if(params.tableformat == TABLE_GATHER && params.sampling == SAMPLING_BILINEAR) {
+                        // The top left pixels of the 2x2 interpolated
+                        const BILINEARTABLE* b = &g_bilineartable[itable];
+                        int wx, wy;
+                        face = lltable[itable].face;
+                        s1.frame = (b->index & GATHER_FRAME2) ? 2 : 1;
+                        s1.index1 = b->index & ~GATHER_FRAME2;
+                        s1.index2 = (b->weight > 0) ? (int)s1.index1 + b->dx : -1;
+                        s0.index1 = BilinearIndex(face, s0.x1, s0.y, &wx, &wy);
+                        if(s0.index2 >= 0) {
+                            s0.index2 = (BlendWeight(s0.alpha) == 0) ? -1 : BilinearIndex(face, s0.x2, s0.y, &wx, &wy);
+                        }
+                    } else if(params.tableformat == TABLE_GATHER) {
+                        const GATHERTABLE* g = &g_gathertable[itable];
+                        face = lltable[itable].face;
+                        s1.frame = (g->index & GATHER_FRAME2) ? 2 : 1;
+                        s1.index1 = g->index & ~GATHER_FRAME2;
+                        s1.index2 = (g->weight > 0) ? (int)s1.index1 + g->dx : -1;
+                        if(s0.index2 >= 0 && BlendWeight(s0.alpha) == 0) s0.index2 = -1;
+                    } else {
+                        if(params.tableformat == TABLE_FOLDED)
+                            face = UnfoldUV(j * params.antialias + aj, i * params.antialias + ai, &uv);
+                        else
+                            face = UnpackUV(g_packedtable[itable], &uv);
+                        ResolveUV(face, uv, &s1);
+                        if(face == lltable[itable].face) {
+                            maxerror = MAX(maxerror, fabs(uv.u - lltable[itable].uv.u) * template[whichtemplate].height);
+                            maxerror = MAX(maxerror, fabs(uv.v - lltable[itable].uv.v) * template[whichtemplate].height);
+                        }
+                    }
+
+                    nsamples++;
+                    if(face != lltable[itable].face) nface++;
+                    else if(s0.frame == s1.frame && s0.index1 == s1.index1 && s0.index2 == s1.index2)
+                        nsame++;
+                }
+            }
+        }
+    }
+    ReleaseTable(&reference);
+
+    fprintf(stderr,
+            "%s() - Validated %s table against the (u,v) table, %ld samples\n",
+            progName,
+            tableformatname[params.tableformat],
+            nsamples);
+    fprintf(stderr, "   Same frame pixels:       %ld\n", nsame);
+    fprintf(stderr, "   Other pixels, same face: %ld\n", nsamples - nsame - nface);
+    fprintf(stderr, "   On a neighbouring face:  %ld\n", nface);
+    if(params.tableformat != TABLE_GATHER) fprintf(stderr, "   Maximum (u,v) error:     %g pixels\n", maxerror);
+
+    return (TRUE);
+}
+
+/*
+    Choose the scale the jpeg frames are decoded at, 1/1, 1/2, 1/4 or 1/8, and scale the frame template to match
+    libjpeg scales in the DCT so most of the decoding work is skipped, automatically the smallest scale
+    is used at which a pixel of the output still spans at least one frame pixel
+    Only scales at which the frame geometry stays in whole pixels are used
+*/
+void ScaleFrames(const char* progName, boolean isjpeg) {
+    FRAMESPECS* t = &template[whichtemplate];
+    int scale = 1;
+
+    if(!isjpeg) {
+        if(params.framescale > 1) fprintf(stderr, "%s() - Only jpeg frames can be decoded scaled, ignoring -r\n", progName);
+        params.framescale = 1;
+        return;
+    }
+    for(int s = 2; s <= 8; s *= 2) {
+        if(t->width % s != 0 || t->height % s != 0 || t->sidewidth % s != 0 || t->centerwidth % s != 0 || t->blendwidth % s != 0)
+            break;
+        if(params.framescale == 0 ? s * params.outwidth > t->equi_width : s > params.framescale) break;
+        scale = s;
+    }
+    if(params.framescale > 1 && scale != params.framescale)
+        fprintf(stderr, "%s() - Frames can't be decoded at 1/%d, using 1/%d\n", progName, params.framescale, scale);
+    params.framescale = scale;
+
+    t->width /= scale;
+    t->height /= scale;
+    t->sidewidth /= scale;
+    t->centerwidth /= scale;
+    t->blendwidth /= scale;
+    t->equi_width /= scale;
+    params.framewidth = t->width;
+    params.frameheight = t->height;
+    if(params.debug) {
+        fprintf(stderr,
+                "%s() - Decoding frames at 1/%d, %li x %li\n",
+                progName,
+                scale,
+                params.framewidth,
+                params.frameheight);
+    }
+}
+
+/*
+    List the frames from n_start to n_stop present in both tracks, scanning the directory of each track once
+    Returns NULL if the template can't be scanned, the frame number is in a directory name or a directory
+    can't be read, the frames are then tried one number after another as before
+    Frames missing from both tracks, and those in only one, are reported
+*/
+size_t* FindFrames(const char* progName, const char* template, size_t* nframes) {
+    char dir[2][256], pattern[2][256];
+    size_t *found[2], nfound[2];
+
+    for(int track = 0; track < 2; track++) {
+        if(!TrackTemplate(template, (track == 0) ? 0 : 5, dir[track], pattern[track])) {
+            if(params.debug) fprintf(stderr, "%s() - Can't scan for frames of \"%s\"\n", progName, template);
+            return (NULL);
+        }
+    }
+    for(int track = 0; track < 2; track++) {
+        if((found[track] = ScanTrack(dir[track], pattern[track], &nfound[track])) == NULL) {
+            if(track > 0) free(found[0]);
+            if(params.debug) fprintf(stderr, "%s() - Can't scan for frames in \"%s\"\n", progName, dir[track]);
+            return (NULL);
+        }
+        qsort(found[track], nfound[track], sizeof(size_t), CompareFrames);
+    }
+
+    // Merge, the paired frames go in the list and the rest are kept to be reported
+    size_t* list = malloc((MIN(nfound[0], nfound[1]) + 1) * sizeof(size_t));
+    size_t* single[2] = { malloc((nfound[0] + 1) * sizeof(size_t)), malloc((nfound[1] + 1) * sizeof(size_t)) };
+    size_t nlist = 0, nsingle[2] = { 0, 0 }, i = 0, j = 0;
+    if(list == NULL || single[0] == NULL || single[1] == NULL) {
+        fprintf(stderr, "%s() - Failed to malloc the frame list\n", progName);
+        exit(-1);
+    }
+    while(i < nfound[0] || j < nfound[1]) {
+        if(j >= nfound[1] || (i < nfound[0] && found[0][i] < found[1][j])) single[0][nsingle[0]++] = found[0][i++];
+        else if(i >= nfound[0] || found[1][j] < found[0][i])
+            single[1][nsingle[1]++] = found[1][j++];
+        else {
+            list[nlist++] = found[0][i];
+            i++;
+            j++;
+        }
+    }
+
+    // Numbers in neither track, between the first and last frame found
+    size_t first = 0, last = 0, nmissing = 0;
+    boolean any = FALSE;
+    for(int track = 0; track < 2; track++) {
+        if(nfound[track] == 0) continue;
+        first = any ? MIN(first, found[track][0]) : found[track][0];
+        last = any ? MAX(last, found[track][nfound[track] - 1]) : found[track][nfound[track] - 1];
+        any = TRUE;
+    }
+    if(any) nmissing = (last - first + 1) - (nlist + nsingle[0] + nsingle[1]);
+
+    if(nmissing > 0 || nsingle[0] > 0 || nsingle[1] > 0 || params.debug) {
+        fprintf(stderr,
+                "%s() - %li frames in both tracks, %li in track 0 only, %li in track 5 only, %li missing from both\n",
+                progName,
+                nlist,
+                nsingle[0],
+                nsingle[1],
+                nmissing);
+        ReportFrames("in track 0 only", progName, single[0], nsingle[0]);
+        ReportFrames("in track 5 only", progName, single[1], nsingle[1]);
+        if(nmissing > 0) {
+            size_t* gaps = malloc(MIN(nmissing, 10) * sizeof(size_t));
+            size_t ngaps = 0;
+            for(size_t n = first; n <= last && gaps != NULL && ngaps < MIN(nmissing, 10); n++) {
+                if(bsearch(&n, found[0], nfound[0], sizeof(size_t), CompareFrames) == NULL &&
+                   bsearch(&n, found[1], nfound[1], sizeof(size_t), CompareFrames) == NULL)
+                    gaps[ngaps++] = n;
+            }
+            ReportFrames("missing from both", progName, gaps, ngaps);
+            free(gaps);
+        }
+    }
+    free(found[0]);
+    free(found[1]);
+    free(single[0]);
+    free(single[1]);
+
+    *nframes = nlist;
+    return (list);
+}
+
+/*
+    Read what is done already into a set, the journal if one is kept, else the listing of the directory
+    the outputs go to, which is the one of the given frame unless the frame number is in a directory name
+*/
+void LoadDone(DONESET* done, const char* progName, const char* template, size_t nframe) {
+    memset(done, 0, sizeof(DONESET));
+#ifdef JOURNALING_ENABLED
+    if(strlen(params.journal) > 0) {
+        done->journal = TRUE;
+        ReadJournal(&done->names, progName);
+        return;
+    }
+#endif
+    OutputDirectory(template, nframe, done->dir, sizeof(done->dir));
+    done->scanned = ScanNames(&done->names, done->dir);
+    if(params.debug) {
+        if(done->scanned)
+            fprintf(stderr,
+                    "%s() - %li files in the output directory \"%s\"\n",
+                    progName,
+                    done->names.count,
+                    done->dir);
+        else
+            fprintf(stderr, "%s() - Can't list \"%s\", checking outputs one by one\n", progName, done->dir);
+    }
+}
+
+/*
+    Drop the frames in the done set from the list, return how many are left, only the set is looked at
+    An output smaller than -M bytes, such as left by a run that was killed, is done again,
+    a frame in the journal counts as done only if it was written under the name it would get now
+*/
+size_t FilterDone(const DONESET* done, const char* progName, const char* template, size_t* framelist, size_t nframes) {
+    char fname1[256], fname2[256], fname[256], line[600];
+    size_t ndone = 0, nsmall = 0;
+    struct stat info;
+
+    for(size_t i = 0; i < nframes; i++) {
+        boolean isdone;
+        set_frame_filename_from_template(fname1, fname2, framelist[i], template);
+        create_output_filename(fname, fname1, framelist[i]);
+        if(done->journal) {
+            snprintf(line, sizeof(line), "%li %s", framelist[i], fname);
+            isdone = HasName(&done->names, line);
+        } else {
+            isdone = OutputExists(&done->names, done->scanned, done->dir, fname);
+            if(isdone && params.minsize > 0 && (stat(fname, &info) != 0 || info.st_size < params.minsize)) {
+                isdone = FALSE;
+                nsmall++;
+            }
+        }
+        if(isdone) ndone++;
+        else
+            framelist[i - ndone] = framelist[i];
+    }
+
+    if(params.debug) fprintf(stderr, "%s() - %li of %li frames done already, skipped\n", progName, ndone, nframes);
+    if(nsmall > 0) fprintf(stderr, "%s() - %li outputs below %ld bytes, done again\n", progName, nsmall, params.minsize);
+    return (nframes - ndone);
+}
+
+/*
+    Drop the frames done already, those in the journal if one is kept, else those with an output
+*/
+size_t DropDone(const char* progName, const char* template, size_t* framelist, size_t nframes) {
+    DONESET done;
+
+    if(nframes == 0) return (0);
+    LoadDone(&done, progName, template, framelist[0]);
+    nframes = FilterDone(&done, progName, template, framelist, nframes);
+    FreeNames(&done.names);
+    return (nframes);
+}
+
+/*
+    The directory the output of a frame goes in
+*/
+void OutputDirectory(const char* template, size_t nframe, char* dir, size_t size) {
+    char fname1[256], fname2[256], fname[256];
+
+    set_frame_filename_from_template(fname1, fname2, nframe, template);
+    create_output_filename(fname, fname1, nframe);
+    char* slash = strrchr(fname, '/');
+    if(slash == NULL) snprintf(dir, size, ".");
+    else
+        snprintf(dir, size, "%.*s", (int)MAX(1, slash - fname), fname);
+}
+
+/*
+    Whether an output exists, from the listing of its directory if it is in the one listed, else checked on its own
+*/
+boolean OutputExists(const NAMESET* existing, boolean scanned, const char* dir, const char* fname) {
+    const char* slash = strrchr(fname, '/');
+    boolean indir = (slash == NULL) ? (strcmp(dir, ".") == 0) : (strncmp(fname, dir, slash - fname) == 0 && dir[slash - fname] == '\0');
+
+    if(scanned && indir) return (HasName(existing, (slash == NULL) ? fname : slash + 1));
+    return (access(fname, F_OK) == 0);
+}
+
+#ifdef JOURNALING_ENABLED
+/*
+    Read the lines of the journal into a set in one pass, a last line cut short by a run that was killed
+    is ignored, the output tree isn't looked at
+*/
+void ReadJournal(NAMESET* recorded, const char* progName) {
+    char line[600];
+    FILE* fptr;
+
+    if((fptr = fopen(params.journal, "r")) != NULL) {
+        while(fgets(line, sizeof(line), fptr) != NULL) {
+            size_t length = strlen(line);
+            if(length == 0 || line[length - 1] != '\n') continue;
+            line[length - 1] = '\0';
+            if(!AddName(recorded, line)) {
+                fprintf(stderr, "%s() - Failed to malloc the journal entries\n", progName);
+                exit(-1);
+            }
+        }
+        fclose(fptr);
+    }
+    if(params.debug) {
+        fprintf(stderr, "%s() - %li frames in the journal \"%s\"\n", progName, recorded->count, params.journal);
+    }
+}
+
+/*
+    Open the journal to append to it, a last line cut short is ended so the next entry starts on a line of its own
+*/
+boolean OpenJournal(JOURNAL* journal, const char* progName) {
+    if((journal->fptr = fopen(params.journal, "a+")) == NULL) {
+        fprintf(stderr, "%s() - Failed to open the journal \"%s\"\n", progName, params.journal);
+        return (FALSE);
+    }
+    if(fseek(journal->fptr, -1, SEEK_END) == 0 && fgetc(journal->fptr) != '\n') fputc('\n', journal->fptr);
+    pthread_mutex_init(&journal->mutex, NULL);
+    journal->pending = 0;
+    journal->nrecorded = 0;
+    return (TRUE);
+}
+
+/*
+    Record a frame once its output has been renamed into place
+    Lines are appended whole, the file is synced every JOURNALBATCH frames rather than for each one
+*/
+void JournalFrame(JOURNAL* journal, size_t nframe, const char* basename) {
+    char fname[256];
+    create_output_filename(fname, basename, nframe);
+
+    pthread_mutex_lock(&journal->mutex);
+    fprintf(journal->fptr, "%li %s\n", nframe, fname);
+    fflush(journal->fptr);
+    journal->nrecorded++;
+    if(++journal->pending >= JOURNALBATCH) {
+        fsync(fileno(journal->fptr));
+        journal->pending = 0;
+    }
+    pthread_mutex_unlock(&journal->mutex);
+}
+
+void CloseJournal(JOURNAL* journal, const char* progName) {
+    fflush(journal->fptr);
+    fsync(fileno(journal->fptr));
+    fclose(journal->fptr);
+    pthread_mutex_destroy(&journal->mutex);
+    if(params.debug) fprintf(stderr, "%s() - %ld frames recorded in the journal\n", progName, journal->nrecorded);
+}
+#endif
+
+/*
+    Keep the frames of this shard, params.shard of params.nshards, from the list of every frame
+    Frames are dealt out in turn, or params.chunk consecutive frames at a time, so every process
+    given the same list and number of shards agrees on which frames are whose
+*/
+size_t SelectShard(size_t* framelist, size_t nframes) {
+    size_t n = 0;
+
+    for(size_t i = 0; i < nframes; i++) {
+        size_t turn = (params.chunk > 0) ? i / params.chunk : i;
+        if(turn % params.nshards == (size_t)(params.shard - 1)) framelist[n++] = framelist[i];
+    }
+    return (n);
+}
+
+/*
+    Room is made for capacity frames, at most the whole list, it doesn't grow
+*/
+boolean InitManifest(MANIFEST* manifest, const size_t* frames, size_t nframes, size_t capacity) {
+    manifest->frames = malloc((capacity + 1) * sizeof(size_t));
+    manifest->entries = malloc((capacity + 1) * sizeof(MANIFESTENTRY));
+    if(manifest->frames == NULL || manifest->entries == NULL) {
+        fprintf(stderr, "InitManifest() - Failed to malloc the manifest of %li frames\n", capacity);
+        return (FALSE);
+    }
+    pthread_mutex_init(&manifest->mutex, NULL);
+    manifest->nframes = 0;
+    manifest->nentries = 0;
+    AddManifestFrames(manifest, frames, nframes);
+    return (TRUE);
+}
+
+void AddManifestFrames(MANIFEST* manifest, const size_t* frames, size_t nframes) {
+    pthread_mutex_lock(&manifest->mutex);
+    if(nframes > 0) memcpy(&manifest->frames[manifest->nframes], frames, nframes * sizeof(size_t));
+    manifest->nframes += nframes;
+    pthread_mutex_unlock(&manifest->mutex);
+}
+
+/*
+    A frame has been through the pipeline, MANIFEST_WRITTEN or MANIFEST_FAILED
+*/
+void RecordManifest(MANIFEST* manifest, size_t nframe, int status) {
+    pthread_mutex_lock(&manifest->mutex);
+    manifest->entries[manifest->nentries].nframe = nframe;
+    manifest->entries[manifest->nentries].status = status;
+    manifest->nentries++;
+    pthread_mutex_unlock(&manifest->mutex);
+}
+
+/*
+    Write the manifest, a "status nframe outputname" line per frame of the shard in frame order
+    Frames that didn't go through the pipeline were done already, "exists"
+    It is written under a temporary name and renamed, so a manifest is only ever seen whole
+*/
+boolean WriteManifest(MANIFEST* manifest,
+                      const char* progName,
+                      const char* template,
+                      const char* dir,
+                      const char* name) {
+    char fname[600], tmpname[610], fname1[256], fname2[256], outname[256];
+    long count[NMANIFESTSTATUS] = { 0, 0, 0 };
+    size_t j = 0;
+    FILE* fptr;
+
+    qsort(manifest->frames, manifest->nframes, sizeof(size_t), CompareFrames);
+    qsort(manifest->entries, manifest->nentries, sizeof(MANIFESTENTRY), CompareEntries);
+
+    snprintf(fname, sizeof(fname), "%s/%s", dir, name);
+    snprintf(tmpname, sizeof(tmpname), "%s.tmp", fname);
+    if((fptr = fopen(tmpname, "w")) == NULL) {
+        fprintf(stderr, "%s() - Failed to open the manifest \"%s\"\n", progName, tmpname);
+        return (FALSE);
+    }
+    fprintf(fptr, "# max2sphere %s, %li frames\n", name, manifest->nframes);
+    for(size_t i = 0; i < manifest->nframes; i++) {
+        int status = MANIFEST_EXISTS;
+        while(j < manifest->nentries && manifest->entries[j].nframe < manifest->frames[i]) j++;
+        if(j < manifest->nentries && manifest->entries[j].nframe == manifest->frames[i]) {
+            status = manifest->entries[j].status;
+        }
+        set_frame_filename_from_template(fname1, fname2, manifest->frames[i], template);
+        create_output_filename(outname, fname1, manifest->frames[i]);
+        fprintf(fptr, "%s %li %s\n", manifeststatusname[status], manifest->frames[i], outname);
+        count[status]++;
+    }
+    boolean ok = (fflush(fptr) == 0 && fsync(fileno(fptr)) == 0);
+    if(fclose(fptr) != 0) ok = FALSE;
+    if(!ok || rename(tmpname, fname) != 0) {
+        fprintf(stderr, "%s() - Failed to write the manifest \"%s\"\n", progName, fname);
+        remove(tmpname);
+        return (FALSE);
+    }
+
+    fprintf(stderr,
+            "%s() - Manifest \"%s\", %ld frames written, %ld done already, %ld failed\n",
+            progName,
+            fname,
+            count[MANIFEST_WRITTEN],
+            count[MANIFEST_EXISTS],
+            count[MANIFEST_FAILED]);
+    return (TRUE);
+}
+
+void FreeManifest(MANIFEST* manifest) {
+    free(manifest->frames);
+    free(manifest->entries);
+    pthread_mutex_destroy(&manifest->mutex);
+}
+
+int CompareEntries(const void* a, const void* b) {
+    const MANIFESTENTRY* ea = (const MANIFESTENTRY*)a;
+    const MANIFESTENTRY* eb = (const MANIFESTENTRY*)b;
+
+    if(ea->nframe < eb->nframe) return (-1);
+    if(ea->nframe > eb->nframe) return (1);
+    return (0);
+}
+
+/*
+    Check the manifests of the shards, the *.manifest files in params.mergedir, cover every frame in the list
+    A frame is covered when a manifest has it written, or done already, under the output name it would get now
+    and that output exists, the covered frames are written to merged.manifest in the same directory
+    Return FALSE if any frame isn't covered
+*/
+boolean MergeManifests(const char* progName, const char* template, const size_t* framelist, size_t nframes) {
+    NAMESET covered = { NULL, 0, 0 }, written = { NULL, 0, 0 }, failed = { NULL, 0, 0 }, existing = { NULL, 0, 0 };
+    char line[600], entry[600], status[16], outname[256], fname[600], tmpname[610], fname1[256], fname2[256], dir[256];
+    size_t nframe, nmissing = 0, nfailed = 0, nrepeated = 0;
+    long nmanifests = 0;
+    struct dirent* dentry;
+    DIR* dptr;
+    FILE* fptr;
+
+    if((dptr = opendir(params.mergedir)) == NULL) {
+        fprintf(stderr, "%s() - Failed to open the manifest directory \"%s\"\n", progName, params.mergedir);
+        return (FALSE);
+    }
+    while((dentry = readdir(dptr)) != NULL) {
+        size_t length = strlen(dentry->d_name);
+        if(length < 9 || strcmp(dentry->d_name + length - 9, ".manifest") != 0) continue;
+        if(strcmp(dentry->d_name, "merged.manifest") == 0) continue;
+        snprintf(fname, sizeof(fname), "%s/%s", params.mergedir, dentry->d_name);
+        if((fptr = fopen(fname, "r")) == NULL) {
+            fprintf(stderr, "%s() - Failed to open the manifest \"%s\"\n", progName, fname);
+            continue;
+        }
+        nmanifests++;
+        while(fgets(line, sizeof(line), fptr) != NULL) {
+            if(sscanf(line, "%15s %zu %255[^\n]", status, &nframe, outname) != 3) continue;
+            snprintf(entry, sizeof(entry), "%li %s", nframe, outname);
+            boolean ok;
+            if(strcmp(status, manifeststatusname[MANIFEST_FAILED]) == 0) ok = AddName(&failed, entry);
+            else if(strcmp(status, manifeststatusname[MANIFEST_WRITTEN]) == 0) {
+                if(HasName(&written, entry)) nrepeated++;
+                ok = AddName(&written, entry) && AddName(&covered, entry);
+            } else
+                ok = AddName(&covered, entry);
+            if(!ok) {
+                fprintf(stderr, "%s() - Failed to malloc the manifest entries\n", progName);
+                exit(-1);
+            }
+        }
+        fclose(fptr);
+    }
+    closedir(dptr);
+
+    // Covered frames must still have their output
+    size_t* missing = malloc((nframes + 1) * sizeof(size_t));
+    snprintf(fname, sizeof(fname), "%s/merged.manifest", params.mergedir);
+    snprintf(tmpname, sizeof(tmpname), "%s.tmp", fname);
+    if(missing == NULL || (fptr = fopen(tmpname, "w")) == NULL) {
+        fprintf(stderr, "%s() - Failed to open the merged manifest \"%s\"\n", progName, tmpname);
+        free(missing);
+        return (FALSE);
+    }
+    OutputDirectory(template, framelist[0], dir, sizeof(dir));
+    boolean scanned = ScanNames(&existing, dir);
+    fprintf(fptr, "# max2sphere merged from %ld manifests, %li frames\n", nmanifests, nframes);
+    for(size_t i = 0; i < nframes; i++) {
+        set_frame_filename_from_template(fname1, fname2, framelist[i], template);
+        create_output_filename(outname, fname1, framelist[i]);
+        snprintf(entry, sizeof(entry), "%li %s", framelist[i], outname);
+        if(HasName(&covered, entry) && OutputExists(&existing, scanned, dir, outname)) {
+            int status = HasName(&written, entry) ? MANIFEST_WRITTEN : MANIFEST_EXISTS;
+            fprintf(fptr, "%s %s\n", manifeststatusname[status], entry);
+        } else {
+            if(HasName(&failed, entry)) nfailed++;
+            missing[nmissing++] = framelist[i];
+        }
+    }
+    boolean ok = (fflush(fptr) == 0);
+    if(fclose(fptr) != 0 || !ok || rename(tmpname, fname) != 0) {
+        fprintf(stderr, "%s() - Failed to write the merged manifest \"%s\"\n", progName, fname);
+        remove(tmpname);
+    }
+
+    fprintf(stderr,
+            "%s() - %ld manifests cover %li of %li frames, %li written more than once\n",
+            progName,
+            nmanifests,
+            nframes - nmissing,
+            nframes,
+            nrepeated);
+    ReportFrames("not covered", progName, missing, nmissing);
+    if(nfailed > 0) fprintf(stderr, "%s() - %li of the frames not covered failed\n", progName, nfailed);
+
+    free(missing);
+    FreeNames(&covered);
+    FreeNames(&written);
+    FreeNames(&failed);
+    FreeNames(&existing);
+    return (nmissing == 0);
+}
+
+/*
+    Set up leasing chunks of the frame list from params.leasedir, which is made if need be
+    A process given a shard starts from its share of the chunks, so processes started together collide less
+*/
+boolean InitLease(LEASE* lease,
+                  const char* progName,
+                  const char* template,
+                  const size_t* frames,
+                  size_t nframes,
+                  MANIFEST* manifest) {
+    struct stat info;
+
+    memset(lease, 0, sizeof(LEASE));
+    lease->frames = frames;
+    lease->nframes = nframes;
+    lease->chunk = (params.chunk > 0) ? params.chunk : LEASECHUNK;
+    lease->nchunks = (nframes + lease->chunk - 1) / lease->chunk;
+    lease->start = (params.nshards > 1) ? (params.shard - 1) * lease->nchunks / params.nshards : 0;
+    lease->template = template;
+    lease->manifest = manifest;
+    pthread_mutex_init(&lease->mutex, NULL);
+    if(gethostname(lease->host, sizeof(lease->host)) != 0) strcpy(lease->host, "localhost");
+    lease->host[sizeof(lease->host) - 1] = '\0';
+
+    mkdir(params.leasedir, 0755);
+    if(stat(params.leasedir, &info) != 0 || !S_ISDIR(info.st_mode)) {
+        fprintf(stderr, "%s() - Failed to make the lease directory \"%s\"\n", progName, params.leasedir);
+        return (FALSE);
+    }
+
+    lease->claimed = malloc((nframes + 1) * sizeof(size_t));
+    lease->chunkof = malloc((nframes + 1) * sizeof(size_t));
+    lease->remaining = calloc(lease->nchunks + 1, sizeof(size_t));
+    lease->held = calloc(lease->nchunks + 1, sizeof(boolean));
+    lease->failed = calloc(lease->nchunks + 1, sizeof(boolean));
+    if(lease->claimed == NULL || lease->chunkof == NULL || lease->remaining == NULL || lease->held == NULL
+       || lease->failed == NULL) {
+        fprintf(stderr, "%s() - Failed to malloc the lease of %li chunks\n", progName, lease->nchunks);
+        return (FALSE);
+    }
+
+    // What is done already is read once, the frames of each chunk leased are checked against it
+    if(params.skip_existing && nframes > 0) LoadDone(&lease->done, progName, template, frames[0]);
+    if(params.debug) {
+        fprintf(stderr,
+                "%s() - Leasing %li chunks of %li frames from \"%s\", starting at chunk %li\n",
+                progName,
+                lease->nchunks,
+                lease->chunk,
+                params.leasedir,
+                lease->start);
+    }
+
+    return (TRUE);
+}
+
+/*
+    Claim chunks until one has frames left to do, they are added to the list of the scheduler
+    Called by a decode thread that found no frame left to claim, not holding the scheduler mutex,
+    chunks are claimed under the mutex of the lease and the frames done already dropped before the list grows
+*/
+void LeaseChunk(SCHEDULER* scheduler, const char* progName) {
+    LEASE* lease = scheduler->lease;
+    size_t* frames;
+    long chunk;
+
+    if((frames = malloc(lease->chunk * sizeof(size_t))) == NULL) {
+        fprintf(stderr, "%s() - Failed to malloc a chunk of %li frames\n", progName, lease->chunk);
+        return;
+    }
+    for(;;) {
+        pthread_mutex_lock(&lease->mutex);
+        chunk = ClaimChunk(lease);
+        pthread_mutex_unlock(&lease->mutex);
+        if(chunk < 0) break;
+
+        size_t first = chunk * lease->chunk;
+        size_t n = MIN(lease->chunk, lease->nframes - first);
+        memcpy(frames, &lease->frames[first], n * sizeof(size_t));
+        if(lease->manifest != NULL) AddManifestFrames(lease->manifest, frames, n);
+        if(params.skip_existing) n = FilterDone(&lease->done, progName, lease->template, frames, n);
+        if(params.debug) fprintf(stderr, "%s() - Leased chunk %ld, %li frames to do\n", progName, chunk, n);
+        if(n == 0) {
+            FinishChunk(chunk);
+            continue;
+        }
+
+        pthread_mutex_lock(&scheduler->mutex);
+        memcpy(&lease->claimed[scheduler->endframe], frames, n * sizeof(size_t));
+        for(size_t i = 0; i < n; i++) lease->chunkof[scheduler->endframe + i] = chunk;
+        lease->remaining[chunk] = n;
+        scheduler->endframe += n;
+        pthread_mutex_unlock(&scheduler->mutex);
+        break;
+    }
+    free(frames);
+}
+
+/*
+    The next chunk that no process holds, once every chunk has been tried those whose lock has not been
+    touched for LEASETIME seconds are taken over, return -1 when none is left
+*/
+long ClaimChunk(LEASE* lease) {
+    while(lease->ntried < lease->nchunks) {
+        size_t chunk = (lease->start + lease->ntried++) % lease->nchunks;
+        if(TakeLease(lease, chunk, FALSE)) return (chunk);
+    }
+    for(size_t chunk = 0; chunk < lease->nchunks; chunk++) {
+        if(!lease->held[chunk] && TakeLease(lease, chunk, TRUE)) return (chunk);
+    }
+    return (-1);
+}
+
+/*
+    Create the lock of a chunk that isn't finished, only one process can, or take over a stale lock
+    The stale lock is first renamed, which only one process can do, and checked again before a new one is created
+*/
+boolean TakeLease(LEASE* lease, size_t chunk, boolean stale) {
+    char lockname[600], donename[600], stalename[700];
+    struct stat info;
+    int fd;
+
+    LeaseNames(chunk, lockname, donename);
+    if(access(donename, F_OK) == 0) return (FALSE);
+    if(stale) {
+        if(stat(lockname, &info) != 0 || time(NULL) - info.st_mtime < LEASETIME) return (FALSE);
+        snprintf(stalename, sizeof(stalename), "%s.%s.%d", lockname, lease->host, (int)getpid());
+        if(rename(lockname, stalename) != 0) return (FALSE);
+
+        // Touched between the check and the rename, the owner is still working, the lock is put back,
+        // linked rather than renamed so that a lock another process has made since is not replaced
+        if(stat(stalename, &info) != 0 || time(NULL) - info.st_mtime < LEASETIME) {
+            if(link(stalename, lockname) == 0 || errno == EEXIST) remove(stalename);
+            else
+                rename(stalename, lockname);
+            return (FALSE);
+        }
+        remove(stalename);
+    }
+    if((fd = open(lockname, O_WRONLY | O_CREAT | O_EXCL, 0644)) < 0) return (FALSE);
+    dprintf(fd, "%s %d\n", lease->host, (int)getpid());
+    close(fd);
+
+    lease->held[chunk] = TRUE;
+    lease->nleased++;
+    if(stale) lease->ntakenover++;
+    return (TRUE);
+}
+
+void LeaseNames(size_t chunk, char* lockname, char* donename) {
+    sprintf(lockname, "%s/chunk_%06li.lock", params.leasedir, chunk);
+    sprintf(donename, "%s/chunk_%06li.done", params.leasedir, chunk);
+}
+
+/*
+    A frame of a leased chunk has left the pipeline, holding the scheduler mutex, only the counts are updated
+    Return CHUNK_LEFT while frames of the chunk are left, its lock is then touched to keep the lease,
+    CHUNK_DONE after the last frame, or CHUNK_FAILED if a frame of it failed, it is not finished then
+    and its lock goes stale so it is tried again
+*/
+int LeaseFrame(LEASE* lease, size_t index, boolean ok, size_t* chunk) {
+    *chunk = lease->chunkof[index];
+    if(!ok) lease->failed[*chunk] = TRUE;
+    if(--lease->remaining[*chunk] > 0) return (CHUNK_LEFT);
+    return (lease->failed[*chunk] ? CHUNK_FAILED : CHUNK_DONE);
+}
+
+/*
+    Touch the lock of a chunk, the lease is kept while its frames are being done
+*/
+void TouchChunk(size_t chunk) {
+    char lockname[600], donename[600];
+
+    LeaseNames(chunk, lockname, donename);
+    utimes(lockname, NULL);
+}
+
+/*
+    Mark a chunk finished, chunk_n.done, the lock is left in place
+*/
+void FinishChunk(size_t chunk) {
+    char lockname[600], donename[600];
+    int fd;
+
+    LeaseNames(chunk, lockname, donename);
+    if((fd = open(donename, O_WRONLY | O_CREAT, 0644)) >= 0) close(fd);
+}
+
+void FreeLease(LEASE* lease, const char* progName) {
+    if(params.debug || lease->ntakenover > 0) {
+        fprintf(stderr,
+                "%s() - Leased %ld chunks of %li frames, %ld taken over from processes that stopped\n",
+                progName,
+                lease->nleased,
+                lease->chunk,
+                lease->ntakenover);
+    }
+    free(lease->claimed);
+    free(lease->chunkof);
+    free(lease->remaining);
+    free(lease->held);
+    free(lease->failed);
+    FreeNames(&lease->done.names);
+    pthread_mutex_destroy(&lease->mutex);
+}
+
+/*
+    Read the names of the files in a directory into a hash set, which starts empty
+*/
+boolean ScanNames(NAMESET* set, const char* dir) {
+    DIR* dptr;
+    struct dirent* entry;
+
+    if((dptr = opendir(dir)) == NULL) return (FALSE);
+    while((entry = readdir(dptr)) != NULL) {
+        if(!AddName(set, entry->d_name)) break;
+    }
+    closedir(dptr);
+    return (TRUE);
+}
+
+/*
+    Add a name to the hash set, it grows to stay at most half full
+*/
+boolean AddName(NAMESET* set, const char* name) {
+    if(2 * (set->count + 1) > set->capacity) {
+        NAMESET bigger = { NULL, MAX(1024, 2 * set->capacity), set->count };
+        if((bigger.names = calloc(bigger.capacity, sizeof(char*))) == NULL) return (FALSE);
+        for(size_t i = 0; i < set->capacity; i++) {
+            if(set->names[i] == NULL) continue;
+            size_t h = HashName(set->names[i]) & (bigger.capacity - 1);
+            while(bigger.names[h] != NULL) h = (h + 1) & (bigger.capacity - 1);
+            bigger.names[h] = set->names[i];
+        }
+        free(set->names);
+        *set = bigger;
+    }
+    size_t h = HashName(name) & (set->capacity - 1);
+    while(set->names[h] != NULL) {
+        if(strcmp(set->names[h], name) == 0) return (TRUE);
+        h = (h + 1) & (set->capacity - 1);
+    }
+    if((set->names[h] = strdup(name)) == NULL) return (FALSE);
+    set->count++;
+    return (TRUE);
+}
+
+boolean HasName(const NAMESET* set, const char* name) {
+    if(set->count == 0) return (FALSE);
+    size_t h = HashName(name) & (set->capacity - 1);
+    while(set->names[h] != NULL) {
+        if(strcmp(set->names[h], name) == 0) return (TRUE);
+        h = (h + 1) & (set->capacity - 1);
+    }
+    return (FALSE);
+}
+
+void FreeNames(NAMESET* set) {
+    for(size_t i = 0; i < set->capacity; i++) free(set->names[i]);
+    free(set->names);
+    set->names = NULL;
+    set->capacity = 0;
+    set->count = 0;
+}
+
+/*
+    FNV-1a
+*/
+size_t HashName(const char* name) {
+    size_t h = 14695981039346656037UL;
+    for(; *name != '\0'; name++) h = (h ^ (unsigned char)*name) * 1099511628211UL;
+    return (h);
+}
+
+/*
+    Report up to 10 frame numbers of a kind
+*/
+void ReportFrames(const char* kind, const char* progName, const size_t* frames, size_t n) {
+    if(n == 0) return;
+    fprintf(stderr, "%s() - Frames %s:", progName, kind);
+    for(size_t i = 0; i < MIN(n, 10); i++) fprintf(stderr, " %li", frames[i]);
+    fprintf(stderr, (n > 10) ? " ...\n" : "\n");
+}
+
+/*
+    The directory and file name pattern of one track, the first %d of the template is the track
+    FALSE unless the frame number, the second %d, is in the file name
+*/
+boolean TrackTemplate(const char* template, int track, char* dir, char* pattern) {
+    char name[256];
+    const char *spec = strchr(template, '%'), *end;
+
+    if(spec == NULL || (end = strchr(spec, 'd')) == NULL) return (FALSE);
+    snprintf(name, sizeof(name), "%.*s%d%s", (int)(spec - template), template, track, end + 1);
+
+    const char* slash = strrchr(name, '/');
+    if(strchr(slash != NULL ? slash : name, '%') == NULL) return (FALSE);
+    if(slash == NULL) {
+        strcpy(dir, ".");
+        strcpy(pattern, name);
+    } else {
+        snprintf(dir, 256, "%.*s", (int)MAX(1, slash - name), name);
+        strcpy(pattern, slash + 1);
+    }
+    return (strchr(pattern, '%') != NULL);
+}
+
+/*
+    The frame numbers from n_start to n_stop of the files in a directory that match the pattern
+*/
+size_t* ScanTrack(const char* dir, const char* pattern, size_t* nfound) {
+    DIR* dptr;
+    struct dirent* entry;
+    size_t n, capacity = 1024, *found;
+
+    if((dptr = opendir(dir)) == NULL) return (NULL);
+    if((found = malloc(capacity * sizeof(size_t))) == NULL) {
+        closedir(dptr);
+        return (NULL);
+    }
+    *nfound = 0;
+    while((entry = readdir(dptr)) != NULL) {
+        if(!MatchFrame(pattern, entry->d_name, &n) || n < params.n_start || n > params.n_stop) continue;
+        if(*nfound == capacity) {
+            capacity *= 2;
+            size_t* more = realloc(found, capacity * sizeof(size_t));
+            if(more == NULL) break;
+            found = more;
+        }
+        found[(*nfound)++] = n;
+    }
+    closedir(dptr);
+    return (found);
+}
+
+/*
+    Does a file name match the pattern, one %d with its width and padding, and if so for which frame
+    The number is read and the name formed again from it, so it must be exactly as the template writes it
+*/
+boolean MatchFrame(const char* pattern, const char* name, size_t* n) {
+    char check[512];
+    const char* spec = strchr(pattern, '%');
+    size_t prefix = spec - pattern;
+
+    if(strncmp(name, pattern, prefix) != 0) return (FALSE);
+    const char* digits = name + prefix;
+    while(*digits == ' ') digits++;
+    if(*digits < '0' || *digits > '9') return (FALSE);
+    *n = strtoul(digits, NULL, 10);
+    snprintf(check, sizeof(check), pattern, (int)*n);
+    return (strcmp(check, name) == 0);
+}
+
+int CompareFrames(const void* a, const void* b) {
+    size_t n1 = *(const size_t*)a, n2 = *(const size_t*)b;
+    return ((n1 > n2) - (n1 < n2));
+}
+
+/*
+    Check the frames
+    - do they exist
+    - are they jpeg or png, from the contents rather than the name, both jpeg can be decoded scaled
+    - are they the same size
+    - determine which frame template we are using
+    Streamed frames, no names, are the size OpenSource() found
+*/
+int CheckFrames(const char* fname1, const char* fname2, size_t* width, size_t* height, boolean* isjpeg) {
+    IMAGEINFO info1, info2;
+    int format1, format2;
+    int w1, h1, w2, h2;
+
+    if(fname1 == NULL || fname2 == NULL) {
+        w1 = w2 = params.streamwidth;
+        h1 = h2 = params.streamheight;
+        *isjpeg = FALSE;
+    } else {
+        if(params.debug) fprintf(stderr, "fname1=%s fname2=%s\n", fname1, fname2);
+
+        // Frame 1
+        if((format1 = ProbeFrame(fname1, &info1)) < 0) return (-1);
+        w1 = info1.width;
+        h1 = info1.height;
+
+        // Frame 2
+        if((format2 = ProbeFrame(fname2, &info2)) < 0) return (-1);
+        w2 = info2.width;
+        h2 = info2.height;
+        *isjpeg = (format1 == JPG && format2 == JPG);
+    }
+
+    // Are they the same size
+    if(w1 != w2 || h1 != h2) {
+        fprintf(stderr, "CheckFrames() - Frame sizes don't match, %d != %d or %d != %d\n", w1, h1, w2, h2);
+        fprintf(stderr, "CheckFrames() - Frame sizes don't match, %d != %d or %d != %d\n", w1, w2, h1, h2);
+        return (-1);
+    }
+
+    int template_n = -1;
+    // Is it a known template?
+    for(int i = 0; i < NTEMPLATE; i++) {
+        if(w1 == template[i].width && h1 == template[i].height) {
+            template_n = i;
+            break;
+        }
+    }
+    if(template_n < 0) {
+        fprintf(stderr, "CheckFrames() - No recognised frame template\n");
+        return (-1);
+    }
+
+    *width = w1;
+    *height = h1;
+
+    return template_n;
+}
+
+// params.skip_existing
+void create_output_filename(char* fname, const char* basename, int nframe) {
+    if(strlen(params.outfilename) < 2) {
+        sprintf(fname, basename, 0, nframe);
+        for(int i = strlen(fname) - 1; i > 0; i--) {
+            if(fname[i] == '.') {
+                fname[i] = '\0';
+                break;
+            }
+        }
+        strcat(fname, (params.outformat == JPG) ? "_sphere.jpg" : "_sphere.png");
+    } else {
+        sprintf(fname, params.outfilename, nframe);
+    }
+}
+
+
+/*
+   Write spherical image, png or jpeg according to params.outformat
+   The file is written as name.tmp and renamed once complete, so a run that is killed leaves no partial output
+   The image is RGB, png is written as RGB and jpeg rows are passed to the encoder straight from the image
+   With -p png bands are deflated by any thread that is free
+    The file name is either using the mask params.outfilename which should have a %d for the frame number
+    or based upon the basename provided which will have two %d locations for track and framenumber
+*/
+int WriteSpherical(SCHEDULER* scheduler, CODEC* codec, const char* basename, int nframe, const BITMAP3* img, int w, int h) {
+    // Create the output file name, written under a temporary name until it is complete
+    char fname[256], tmpname[300];
+    create_output_filename(fname, basename, nframe);
+    snprintf(tmpname, sizeof(tmpname), "%s.tmp", fname);
+
+    if(params.debug) fprintf(stderr, "WriteSpherical() - Saving file \"%s\"\n", fname);
+
+    // Save
+    FILE* fptr;
+    if((fptr = fopen(tmpname, "wb")) == NULL) {
+        fprintf(stderr, "WriteSpherical() - Failed to open output file \"%s\"\n", tmpname);
+        return (FALSE);
+    }
+
+    boolean status;
+    if(params.outformat == JPG) {
+        codec->fullchroma = params.fullchroma;
+        status = JPEG_WriteCodec3(codec, fptr, img, w, h, params.quality); // Positive, rows are stored bottom up
+    } else {
+        codec->pnglevel = params.pnglevel;
+        codec->pngfilter = params.pngfilter;
+        if(params.parallelpng && params.threads > 1) status = EncodeShared(scheduler, codec, img, fptr);
+        else
+            status = !PNG_WriteCodec3(codec, fptr, img, w, h, FALSE);
+    }
+    if(fclose(fptr) != 0) status = FALSE;
+    if(status && rename(tmpname, fname) != 0) {
+        fprintf(stderr, "WriteSpherical() - Failed to rename \"%s\" to \"%s\"\n", tmpname, fname);
+        status = FALSE;
+    } else if(!status) {
+        fprintf(stderr, "WriteSpherical() - Failed to write output file \"%s\"\n", fname);
+    }
+    if(!status) remove(tmpname);
+
+    return (status);
+}
+
+/*
+    Open the stream, the -o file or named pipe, stdout if none or "-", and write the y4m header
+    window frames are held at most, converted, waiting for the frames before them to be written
+*/
+boolean OpenSink(SINK* sink, const char* progName, size_t firstframe, size_t window) {
+    size_t npixels = (size_t)params.outwidth * params.outheight;
+
+    if(params.outformat == RAWRGB) sink->framesize = 3 * npixels;
+    else
+        sink->framesize = 6 + (params.fullchroma ? 3 * npixels : npixels + npixels / 2); // "FRAME\n" and the planes
+
+    pthread_mutex_init(&sink->mutex, NULL);
+    pthread_cond_init(&sink->cond, NULL);
+    sink->next = firstframe;
+    sink->window = window;
+    sink->writing = FALSE;
+    sink->failed = FALSE;
+    sink->nwritten = 0;
+    sink->nmissing = 0;
+    if((sink->slots = calloc(window, sizeof(SINKSLOT))) == NULL) {
+        fprintf(stderr, "%s() - Failed to malloc the stream buffers\n", progName);
+        return (FALSE);
+    }
+    for(size_t n = 0; n < window; n++) {
+        if((sink->slots[n].data = malloc(sink->framesize)) == NULL) {
+            fprintf(stderr, "%s() - Failed to malloc the stream buffers\n", progName);
+            return (FALSE);
+        }
+    }
+
+    if(strlen(params.outfilename) == 0 || strcmp(params.outfilename, "-") == 0) {
+        sink->fptr = stdout;
+    } else if((sink->fptr = fopen(params.outfilename, "wb")) == NULL) {
+        fprintf(stderr, "%s() - Failed to open output stream \"%s\"\n", progName, params.outfilename);
+        return (FALSE);
+    }
+
+    // Full range BT.601, as jpeg, so a stream and jpeg frames from the same images match
+    if(params.outformat == Y4M) {
+        fprintf(sink->fptr,
+                "YUV4MPEG2 W%d H%d F%s Ip A1:1 %s XCOLORRANGE=FULL\n",
+                params.outwidth,
+                params.outheight,
+                params.framerate,
+                params.fullchroma ? "C444" : "C420jpeg");
+    }
+    if(params.debug) {
+        fprintf(stderr,
+                "%s() - Streaming %s %dx%d to \"%s\", %ld frames held at most\n",
+                progName,
+                (params.outformat == Y4M) ? "y4m" : "rgb24",
+                params.outwidth,
+                params.outheight,
+                (sink->fptr == stdout) ? "stdout" : params.outfilename,
+                (long)window);
+    }
+
+    return (TRUE);
+}
+
+/*
+    Pass frame nframe to the stream, frames are written in frame order whichever thread formed them
+    A frame that couldn't be formed is passed as NULL and skipped, so the frames after it aren't held up
+    Waits while the frame is window or more frames ahead of the next frame to be written, which caps the memory
+    The conversion is done by the calling thread, the writing by whichever thread completes the next frame
+*/
+boolean SinkFrame(SINK* sink, size_t nframe, const BITMAP3* img) {
+    pthread_mutex_lock(&sink->mutex);
+    while(nframe >= sink->next + sink->window) pthread_cond_wait(&sink->cond, &sink->mutex);
+    SINKSLOT* slot = &sink->slots[nframe % sink->window];
+    pthread_mutex_unlock(&sink->mutex);
+
+    if(img != NULL) StreamFrame(slot->data, img);
+
+    pthread_mutex_lock(&sink->mutex);
+    slot->nframe = nframe;
+    slot->missing = (img == NULL);
+    slot->ready = TRUE;
+
+    // One thread at a time writes out every frame that is ready, in order
+    if(!sink->writing) {
+        sink->writing = TRUE;
+        for(;;) {
+            SINKSLOT* head = &sink->slots[sink->next % sink->window];
+            if(!head->ready || head->nframe != sink->next) break;
+            pthread_mutex_unlock(&sink->mutex);
+            boolean ok = head->missing || fwrite(head->data, 1, sink->framesize, sink->fptr) == sink->framesize;
+            pthread_mutex_lock(&sink->mutex);
+            if(!ok && !sink->failed) {
+                fprintf(stderr, "SinkFrame() - Failed to write frame %ld to the output stream\n", (long)sink->next);
+                sink->failed = TRUE;
+            }
+            if(head->missing) sink->nmissing++;
+            else
+                sink->nwritten++;
+            head->ready = FALSE;
+            sink->next++;
+            pthread_cond_broadcast(&sink->cond);
+        }
+        sink->writing = FALSE;
+    }
+    pthread_mutex_unlock(&sink->mutex);
+
+    return (img != NULL && !sink->failed);
+}
+
+void CloseSink(SINK* sink, const char* progName) {
+    fflush(sink->fptr);
+    if(sink->fptr != stdout) fclose(sink->fptr);
+    if(params.debug)
+        fprintf(stderr, "%s() - Streamed %ld frames, %ld missing\n", progName, sink->nwritten, sink->nmissing);
+    for(int n = 0; n < sink->window; n++) free(sink->slots[n].data);
+    free(sink->slots);
+    pthread_mutex_destroy(&sink->mutex);
+    pthread_cond_destroy(&sink->cond);
+}
+
+/*
+    Convert a frame for the stream, top row first, raw RGB or a y4m frame, planar YUV 4:2:0 or 4:4:4
+    The image is stored bottom row first
+*/
+void StreamFrame(unsigned char* out, const BITMAP3* img) {
+    int w = params.outwidth, h = params.outheight;
+
+    if(params.outformat == RAWRGB) {
+        for(int j = 0; j < h; j++) memcpy(&out[3 * (size_t)j * w], &img[(size_t)(h - 1 - j) * w], 3 * (size_t)w);
+        return;
+    }
+
+    memcpy(out, "FRAME\n", 6);
+    unsigned char* y = out + 6;
+    unsigned char* u = y + (size_t)w * h;
+    if(params.fullchroma) {
+        unsigned char* v = u + (size_t)w * h;
+        for(int j = 0; j < h; j++) {
+            size_t k = (size_t)j * w;
+            RGBToYUV444Kernel(&img[(size_t)(h - 1 - j) * w], &y[k], &u[k], &v[k], w);
+        }
+    } else {
+        unsigned char* v = u + (size_t)(w / 2) * (h / 2);
+        for(int j = 0; j < h; j += 2) {
+            size_t k = (size_t)(j / 2) * (w / 2);
+            RGBToYUV420Kernel(&img[(size_t)(h - 1 - j) * w],
+                              &img[(size_t)(h - 2 - j) * w],
+                              &y[(size_t)j * w],
+                              &y[(size_t)(j + 1) * w],
+                              &u[k],
+                              &v[k],
+                              w);
+        }
+    }
+}
+
+/*
+    Full range BT.601 RGB to YUV, as jpeg, in 14 bit fixed point, the AVX2 versions give the same results
+    Chroma of 4:2:0 is from the sum of each 2x2 block, so 16 bits
+*/
+void RGBToYUV444Span(const BITMAP3* rgb, unsigned char* y, unsigned char* u, unsigned char* v, int n) {
+    for(int i = 0; i < n; i++) {
+        int r = rgb[i].r, g = rgb[i].g, b = rgb[i].b;
+        y[i] = (4899 * r + 9617 * g + 1868 * b + 8192) >> 14;
+        u[i] = MIN(255, ((-2765 * r - 5427 * g + 8192 * b + 8192) >> 14) + 128);
+        v[i] = MIN(255, ((8192 * r - 6860 * g - 1332 * b + 8192) >> 14) + 128);
+    }
+}
+
+/*
+    Two rows, n pixels wide, to two rows of Y and one of each of U and V
+*/
+void RGBToYUV420Span(const BITMAP3* rgb0, const BITMAP3* rgb1, unsigned char* y0, unsigned char* y1, unsigned char* u, unsigned char* v, int n) {
+    for(int i = 0; i < n; i += 2) {
+        int r = 0, g = 0, b = 0;
+        for(int k = i; k < i + 2; k++) {
+            y0[k] = (4899 * rgb0[k].r + 9617 * rgb0[k].g + 1868 * rgb0[k].b + 8192) >> 14;
+            y1[k] = (4899 * rgb1[k].r + 9617 * rgb1[k].g + 1868 * rgb1[k].b + 8192) >> 14;
+            r += rgb0[k].r + rgb1[k].r;
+            g += rgb0[k].g + rgb1[k].g;
+            b += rgb0[k].b + rgb1[k].b;
+        }
+        u[i / 2] = MIN(255, ((-2765 * r - 5427 * g + 8192 * b + 32768) >> 16) + 128);
+        v[i / 2] = MIN(255, ((8192 * r - 6860 * g - 1332 * b + 32768) >> 16) + 128);
+    }
+}
+
+#ifdef REMAP_X86
+/*
+    8 RGB pixels into the lanes of two registers as 16 bit pairs, (r,g) and (b,1), for madd with the
+    coefficient pairs, only the 24 bytes of the pixels are read
+*/
+__attribute__((target("avx2"))) void RGBToPairsAVX2(const BITMAP3* rgb, __m256i* rg, __m256i* b1) {
+    const __m256i rgmask = _mm256_setr_epi8(0, -1, 1, -1, 3, -1, 4, -1, 6, -1, 7, -1, 9, -1, 10, -1,
+                                            0, -1, 1, -1, 3, -1, 4, -1, 6, -1, 7, -1, 9, -1, 10, -1);
+    const __m256i bmask = _mm256_setr_epi8(2, -1, -1, -1, 5, -1, -1, -1, 8, -1, -1, -1, 11, -1, -1, -1,
+                                           2, -1, -1, -1, 5, -1, -1, -1, 8, -1, -1, -1, 11, -1, -1, -1);
+    const unsigned char* p = (const unsigned char*)rgb;
+    __m128i lo = _mm_loadu_si128((const __m128i*)p);
+    __m128i hi = _mm_srli_si128(_mm_loadu_si128((const __m128i*)(p + 8)), 4);
+    __m256i c = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+
+    *rg = _mm256_shuffle_epi8(c, rgmask);
+    *b1 = _mm256_or_si256(_mm256_shuffle_epi8(c, bmask), _mm256_set1_epi32(0x10000));
+}
+
+/*
+    Low byte of each of the 8 lanes to 8 bytes
+*/
+__attribute__((target("avx2"))) void StoreBytesAVX2(unsigned char* out, __m256i x) {
+    const __m256i bytes = _mm256_setr_epi8(0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                           0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    x = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(x, bytes), _mm256_setr_epi32(0, 4, 0, 0, 0, 0, 0, 0));
+    _mm_storel_epi64((__m128i*)out, _mm256_castsi256_si128(x));
+}
+
+/*
+    AVX2 version of RGBToYUV444Span(), 8 pixels at a time
+*/
+__attribute__((target("avx2"))) void RGBToYUV444AVX2Span(const BITMAP3* rgb, unsigned char* y, unsigned char* u, unsigned char* v, int n) {
+    const __m256i yrg = _mm256_set1_epi32((9617 << 16) | 4899), yb = _mm256_set1_epi32((8192 << 16) | 1868);
+    const __m256i urg = _mm256_set1_epi32((int)(((unsigned)-5427 << 16) | (-2765 & 0xFFFF))), ub = _mm256_set1_epi32((8192 << 16) | 8192);
+    const __m256i vrg = _mm256_set1_epi32((int)(((unsigned)-6860 << 16) | 8192)), vb = _mm256_set1_epi32((8192 << 16) | (-1332 & 0xFFFF));
+    const __m256i offset = _mm256_set1_epi32(128), max = _mm256_set1_epi32(255);
+    int i;
+
+    for(i = 0; i + 8 <= n; i += 8) {
+        __m256i rg, b1;
+        RGBToPairsAVX2(&rgb[i], &rg, &b1);
+        __m256i ys = _mm256_srai_epi32(_mm256_add_epi32(_mm256_madd_epi16(rg, yrg), _mm256_madd_epi16(b1, yb)), 14);
+        __m256i us = _mm256_srai_epi32(_mm256_add_epi32(_mm256_madd_epi16(rg, urg), _mm256_madd_epi16(b1, ub)), 14);
+        __m256i vs = _mm256_srai_epi32(_mm256_add_epi32(_mm256_madd_epi16(rg, vrg), _mm256_madd_epi16(b1, vb)), 14);
+        StoreBytesAVX2(&y[i], ys);
+        StoreBytesAVX2(&u[i], _mm256_min_epi32(_mm256_add_epi32(us, offset), max));
+        StoreBytesAVX2(&v[i], _mm256_min_epi32(_mm256_add_epi32(vs, offset), max));
+    }
+    RGBToYUV444Span(&rgb[i], &y[i], &u[i], &v[i], n - i);
+}
+
+/*
+    AVX2 version of RGBToYUV420Span(), 8 pixels of each row at a time
+    The (r,g) and (b,1) pairs of the 2x2 blocks are summed in place, the 1 becomes 4 for the rounding
+*/
+__attribute__((target("avx2"))) void RGBToYUV420AVX2Span(const BITMAP3* rgb0, const BITMAP3* rgb1, unsigned char* y0, unsigned char* y1, unsigned char* u, unsigned char* v, int n) {
+    const __m256i yrg = _mm256_set1_epi32((9617 << 16) | 4899), yb = _mm256_set1_epi32((8192 << 16) | 1868);
+    const __m256i urg = _mm256_set1_epi32((int)(((unsigned)-5427 << 16) | (-2765 & 0xFFFF))), ub = _mm256_set1_epi32((8192 << 16) | 8192);
+    const __m256i vrg = _mm256_set1_epi32((int)(((unsigned)-6860 << 16) | 8192)), vb = _mm256_set1_epi32((8192 << 16) | (-1332 & 0xFFFF));
+    const __m256i offset = _mm256_set1_epi32(128), max = _mm256_set1_epi32(255);
+    int i;
+
+    for(i = 0; i + 8 <= n; i += 8) {
+        __m256i rg0, b10, rg1, b11;
+        RGBToPairsAVX2(&rgb0[i], &rg0, &b10);
+        RGBToPairsAVX2(&rgb1[i], &rg1, &b11);
+        StoreBytesAVX2(&y0[i], _mm256_srai_epi32(_mm256_add_epi32(_mm256_madd_epi16(rg0, yrg), _mm256_madd_epi16(b10, yb)), 14));
+        StoreBytesAVX2(&y1[i], _mm256_srai_epi32(_mm256_add_epi32(_mm256_madd_epi16(rg1, yrg), _mm256_madd_epi16(b11, yb)), 14));
+
+        // Pairs of columns summed, 2 blocks in the low lanes of each half
+        __m256i rg = _mm256_add_epi32(rg0, rg1), b1 = _mm256_add_epi32(b10, b11);
+        rg = _mm256_hadd_epi32(rg, rg);
+        b1 = _mm256_hadd_epi32(b1, b1);
+        __m256i us = _mm256_srai_epi32(_mm256_add_epi32(_mm256_madd_epi16(rg, urg), _mm256_madd_epi16(b1, ub)), 16);
+        __m256i vs = _mm256_srai_epi32(_mm256_add_epi32(_mm256_madd_epi16(rg, vrg), _mm256_madd_epi16(b1, vb)), 16);
+        unsigned char ubytes[8], vbytes[8];
+        StoreBytesAVX2(ubytes, _mm256_min_epi32(_mm256_add_epi32(us, offset), max));
+        StoreBytesAVX2(vbytes, _mm256_min_epi32(_mm256_add_epi32(vs, offset), max));
+        memcpy(&u[i / 2], ubytes, 2);
+        memcpy(&u[i / 2 + 2], &ubytes[4], 2);
+        memcpy(&v[i / 2], vbytes, 2);
+        memcpy(&v[i / 2 + 2], &vbytes[4], 2);
+    }
+    RGBToYUV420Span(&rgb0[i], &rgb1[i], &y0[i], &y1[i], &u[i / 2], &v[i / 2], n - i);
+}
+#endif
+
+/*
+    Read just the header of a frame, it must be a jpeg or png that ReadFrame() can decode
+    Return JPG or PNG, -1 if it can't be used
+*/
+int ProbeFrame(const char* fname, IMAGEINFO* info) {
+    FILE* fptr;
+    int format;
+
+    if((fptr = fopen(fname, "rb")) == NULL) {
+        fprintf(stderr, "CheckFrames() - Failed to open frame \"%s\"\n", fname);
+        return (-1);
+    }
+    format = Probe_Image(fptr, info);
+    fclose(fptr);
+
+    if(format != JPG && format != PNG) {
+        fprintf(stderr, "CheckFrames() - \"%s\" is not a jpeg or png file\n", fname);
+        return (-1);
+    }
+    if(format == JPG && (info->components != 3 || info->bitdepth != 8)) {
+        fprintf(stderr, "CheckFrames() - \"%s\" is not an 8 bit RGB jpeg\n", fname);
+        return (-1);
+    }
+    if(params.debug) {
+        fprintf(stderr,
+                "CheckFrames() - \"%s\" is a %s, %d x %d, %d components of %d bits\n",
+                fname,
+                format == JPG ? "jpeg" : "png",
+                info->width,
+                info->height,
+                info->components,
+                info->bitdepth);
+    }
+
+    return (format);
+}
+
+/*
+   Read a frame, the format is taken from the contents
+   The codec of the calling thread is reused from frame to frame, jpeg frames are decoded at params.framescale
+*/
+int ReadFrame(CODEC* codec, BITMAP4* img, char* fname, int w, int h) {
+    FILE* fptr;
+    int format, status = -1;
+
+    if(params.debug) fprintf(stderr, "ReadFrame() - Reading image \"%s\"\n", fname);
+
+    // Attempt to open file
+    if((fptr = fopen(fname, "rb")) == NULL) {
+        fprintf(stderr, "ReadFrame() - Failed to open \"%s\"\n", fname);
+        return (FALSE);
+    }
+
+    // Read image data
+    format = Detect_Format(fptr);
+    codec->scaledenom = params.framescale;
+    if(format == JPG) status = JPEG_ReadCodec(codec, fptr, img, &w, &h);
+    else if(format == PNG && params.framescale == 1)
+        status = PNG_ReadCodec(codec, fptr, img, &w, &h);
+    fclose(fptr);
+    if(status != 0) {
+        fprintf(stderr, "ReadFrame() - Failed to correctly read JPG/PNG file \"%s\"\n", fname);
+        return (FALSE);
+    }
+
+    return (TRUE);
+}
+
+/*
+   As ReadFrame() for a frame file already read into memory, NULL if it couldn't be read
+*/
+int ReadFrameMem(CODEC* codec, BITMAP4* img, const unsigned char* data, size_t size, const char* fname, int w, int h) {
+    int format, status = -1;
+
+    if(data == NULL) {
+        fprintf(stderr, "ReadFrameMem() - Failed to read \"%s\"\n", fname);
+        return (FALSE);
+    }
+
+    format = Detect_FormatMem(data, size);
+    codec->scaledenom = params.framescale;
+    if(format == JPG) status = JPEG_ReadCodecMem(codec, data, size, img, &w, &h);
+    else if(format == PNG && params.framescale == 1)
+        status = PNG_ReadCodecMem(codec, data, size, img, &w, &h);
+    if(status != 0) {
+        fprintf(stderr, "ReadFrameMem() - Failed to correctly read JPG/PNG file \"%s\"\n", fname);
+        return (FALSE);
+    }
+
+    return (TRUE);
+}
+
+/*
+   Open the streams of the two tracks, named by one %d for the track number, 0 and 5, or as a pair "name0,name5"
+   Either can be "-" for stdin, a descriptor can be given as /dev/fd/n
+   The frame size is from the y4m headers, which must agree, or -S for raw streams
+*/
+boolean OpenSource(SOURCE* source, const char* progName, const char* names) {
+    char fname[2][256];
+    const char* comma = strchr(names, ',');
+
+    if(comma != NULL) {
+        snprintf(fname[0], sizeof(fname[0]), "%.*s", (int)(comma - names), names);
+        snprintf(fname[1], sizeof(fname[1]), "%s", comma + 1);
+    } else if(CheckTemplate((char*)names, 1)) {
+        snprintf(fname[0], sizeof(fname[0]), names, 0);
+        snprintf(fname[1], sizeof(fname[1]), names, 5);
+    } else {
+        return (FALSE);
+    }
+    if(strcmp(fname[0], "-") == 0 && strcmp(fname[1], "-") == 0) {
+        fprintf(stderr, "%s() - Only one of the streams can be stdin\n", progName);
+        return (FALSE);
+    }
+
+    pthread_mutex_init(&source->mutex, NULL);
+    pthread_cond_init(&source->cond, NULL);
+    source->format = params.informat;
+    source->fullrange = FALSE;
+    source->width = params.streamwidth;
+    source->height = params.streamheight;
+    source->next = params.n_start;
+    source->ended = FALSE;
+    source->nread = 0;
+
+    for(int track = 0; track < 2; track++) {
+        if(strcmp(fname[track], "-") == 0) {
+            source->fptr[track] = stdin;
+        } else if((source->fptr[track] = fopen(fname[track], "rb")) == NULL) {
+            fprintf(stderr, "%s() - Failed to open stream \"%s\"\n", progName, fname[track]);
+            return (FALSE);
+        }
+        if(source->format == STREAM_Y4M) {
+            int w, h;
+            boolean fullrange;
+            if(!ReadY4MHeader(source->fptr[track], fname[track], &w, &h, &fullrange)) return (FALSE);
+            if(track > 0 && (w != source->width || h != source->height || fullrange != source->fullrange)) {
+                fprintf(stderr, "%s() - Streams don't match, %d x %d and %d x %d\n", progName, source->width, source->height, w, h);
+                return (FALSE);
+            }
+            source->width = w;
+            source->height = h;
+            source->fullrange = fullrange;
+        }
+    }
+
+    if(source->width <= 0 || source->height <= 0) {
+        fprintf(stderr, "%s() - The frame size of raw streams is needed, see -S\n", progName);
+        return (FALSE);
+    }
+    if(source->format != STREAM_RGB && (source->width % 2 != 0 || source->height % 2 != 0)) {
+        fprintf(stderr, "%s() - YUV 4:2:0 frames must be an even size, not %d x %d\n", progName, source->width, source->height);
+        return (FALSE);
+    }
+    if(source->format == STREAM_RGB) source->framesize = 3 * (size_t)source->width * source->height;
+    else
+        source->framesize = (size_t)source->width * source->height * 3 / 2;
+    params.streamwidth = source->width;
+    params.streamheight = source->height;
+
+    if(params.debug) {
+        fprintf(stderr,
+                "%s() - Reading %s frames %d x %d from \"%s\" and \"%s\"\n",
+                progName,
+                (source->format == STREAM_RGB) ? "rgb24" : (source->fullrange ? "full range yuv420" : "yuv420"),
+                source->width,
+                source->height,
+                fname[0],
+                fname[1]);
+    }
+
+    return (TRUE);
 }
 
+/*
+   Read the header line of a y4m stream, only 4:2:0 progressive frames are supported
+   The chroma siting of the 4:2:0 variants is ignored, the range is limited unless XCOLORRANGE=FULL
+*/
+boolean ReadY4MHeader(FILE* fptr, const char* fname, int* width, int* height, boolean* fullrange) {
+    char line[1024], *token, *next;
 
-void* worker_function(void* input) {
-    // Cast the pointer to the correct type
-    THREAD_DATA* data = (THREAD_DATA*)input;
+    if(fgets(line, sizeof(line), fptr) == NULL || strncmp(line, "YUV4MPEG2 ", 10) != 0) {
+        fprintf(stderr, "ReadY4MHeader() - \"%s\" is not a y4m stream\n", fname);
+        return (FALSE);
+    }
+    *width = 0;
+    *height = 0;
+    *fullrange = FALSE;
+    for(token = strtok_r(line + 10, " \n", &next); token != NULL; token = strtok_r(NULL, " \n", &next)) {
+        if(token[0] == 'W') *width = atoi(token + 1);
+        else if(token[0] == 'H')
+            *height = atoi(token + 1);
+        else if(token[0] == 'C' && strncmp(token, "C420", 4) != 0) {
+            fprintf(stderr, "ReadY4MHeader() - \"%s\" is %s, only 4:2:0 is supported\n", fname, token + 1);
+            return (FALSE);
+        } else if(token[0] == 'I' && token[1] != 'p' && token[1] != '?') {
+            fprintf(stderr, "ReadY4MHeader() - \"%s\" is interlaced, only progressive frames are supported\n", fname);
+            return (FALSE);
+        } else if(strcmp(token, "XCOLORRANGE=FULL") == 0)
+            *fullrange = TRUE;
+    }
 
-    for(;;) {
-        pthread_mutex_lock(data->counter_mutex);
-        size_t nframe = *(data->ip_shared_counter);
-        (*(data->ip_shared_counter))++;
-        pthread_mutex_unlock(data->counter_mutex);
+    return (TRUE);
+}
 
-        if(nframe > params.n_stop) { break; }
+/*
+   Read frame nframe of both tracks into raw, one after the other
+   The streams are read in frame order so the thread with the next frame goes first, others wait for their turn
+   Returns FALSE once either stream has ended, for this and every later frame, so nothing follows it in the output
+*/
+boolean ReadSourceFrames(SOURCE* source, size_t nframe, unsigned char* raw) {
+    char line[256];
 
-        if(params.debug) {
-            fprintf(stderr, "%s() T%02li - starting job %li\n", data->progName, data->worker_id, nframe);
-        }
-        process_single_image(data, nframe);
-        if(params.debug) {
-            fprintf(stderr, "%s() T%02li - finished job %li\n", data->progName, data->worker_id, nframe);
+    pthread_mutex_lock(&source->mutex);
+    while(source->next != nframe && !source->ended) pthread_cond_wait(&source->cond, &source->mutex);
+    for(int track = 0; track < 2 && !source->ended; track++) {
+        // A y4m frame header can carry parameters, they apply to this frame only and are ignored
+        if(source->format == STREAM_Y4M &&
+           (fgets(line, sizeof(line), source->fptr[track]) == NULL || strncmp(line, "FRAME", 5) != 0)) {
+            source->ended = TRUE;
+        } else if(fread(raw + track * source->framesize, 1, source->framesize, source->fptr[track]) != source->framesize) {
+            source->ended = TRUE;
         }
     }
-    if(params.debug) { fprintf(stderr, "%s() T%02li - finished all jobs\n", data->progName, data->worker_id); }
-    return NULL;
-}
-
+    boolean status = !source->ended;
+    if(status) {
+        source->next++;
+        source->nread++;
+    }
+    pthread_cond_broadcast(&source->cond);
+    pthread_mutex_unlock(&source->mutex);
 
-void process_single_image(THREAD_DATA* data, int nframe) {
-    char fname1[256], fname2[256];
-    set_frame_filename_from_template(fname1, fname2, nframe, data->last_argument);
+    return (status);
+}
 
-    if(params.skip_existing) {
-        // Create the output file name
-        char fname_out[256];
-        create_output_filename(fname_out, fname1, nframe);
+/*
+   Convert a streamed frame, top row first, to a frame as read from an image, bottom row first
+   YUV is BT.601 in 14 bit fixed point, as a jpeg decoder, the chroma of each 2x2 block is shared
+*/
+void SourceToFrame(const SOURCE* source, const unsigned char* raw, BITMAP4* frame) {
+    int w = source->width, h = source->height;
 
-        if(access(fname_out, F_OK) == 0) {
-            if(params.debug) {
-                fprintf(stderr,
-                        "%s() T%02li - skipping frame, already exists \"%s\"\n",
-                        data->progName,
-                        data->worker_id,
-                        fname_out);
+    if(source->format == STREAM_RGB) {
+        for(int j = 0; j < h; j++) {
+            const unsigned char* rgb = &raw[3 * (size_t)j * w];
+            BITMAP4* row = &frame[(size_t)(h - 1 - j) * w];
+            for(int i = 0; i < w; i++) {
+                row[i].r = rgb[3 * i];
+                row[i].g = rgb[3 * i + 1];
+                row[i].b = rgb[3 * i + 2];
+                row[i].a = 255;
             }
-            return;
-        } else if(params.debug) {
-            fprintf(stderr, "%s() T%02li - NOT skipping frame \"%s\"\n", data->progName, data->worker_id, fname_out);
         }
+        return;
     }
 
-    if(data->frame_input1 == NULL || data->frame_input2 == NULL || data->frame_spherical == NULL) {
-        fprintf(stderr, "%s() T%02li - Failed to malloc memory for the images\n", data->progName, data->worker_id);
-        exit(-1);
+    // Luma scale and chroma coefficients, (R,V), (G,U), (G,V), (B,U)
+    int y0 = 16, ky = 19077, krv = 26149, kgu = 6419, kgv = 13320, kbu = 33050;
+    if(source->fullrange) {
+        y0 = 0;
+        ky = 16384;
+        krv = 22970;
+        kgu = 5638;
+        kgv = 11700;
+        kbu = 29032;
     }
-
-    // Form the spherical map
-    if(params.debug)
-        fprintf(stderr, "%s() T%02li - Creating spherical map for frame %d\n", data->progName, data->worker_id, nframe);
-    BITMAP4 black = { 0, 0, 0, 255 };
-    Erase_Bitmap(data->frame_spherical, params.outwidth, params.outheight, black);
-
-    // Read both frames
-    if(!ReadFrame(data->frame_input1, fname1, params.framewidth, params.frameheight)) {
-        if(params.debug)
-            fprintf(stderr, "%s() T%02li - failed to read frame \"%s\"\n", data->progName, data->worker_id, fname2);
-        return;
+    const unsigned char* yplane = raw;
+    const unsigned char* uplane = yplane + (size_t)w * h;
+    const unsigned char* vplane = uplane + (size_t)(w / 2) * (h / 2);
+    for(int j = 0; j < h; j++) {
+        const unsigned char* yrow = &yplane[(size_t)j * w];
+        const unsigned char* urow = &uplane[(size_t)(j / 2) * (w / 2)];
+        const unsigned char* vrow = &vplane[(size_t)(j / 2) * (w / 2)];
+        BITMAP4* row = &frame[(size_t)(h - 1 - j) * w];
+        for(int i = 0; i < w; i += 2) {
+            int u = urow[i / 2] - 128, v = vrow[i / 2] - 128;
+            int r = krv * v + 8192, g = 8192 - kgu * u - kgv * v, b = kbu * u + 8192;
+            for(int k = i; k < i + 2; k++) {
+                int y = (yrow[k] - y0) * ky;
+                row[k].r = MAX(0, MIN(255, (y + r) >> 14));
+                row[k].g = MAX(0, MIN(255, (y + g) >> 14));
+                row[k].b = MAX(0, MIN(255, (y + b) >> 14));
+                row[k].a = 255;
+            }
+        }
     }
+}
 
-    if(!ReadFrame(data->frame_input2, fname2, params.framewidth, params.frameheight)) {
-        if(params.debug)
-            fprintf(stderr, "%s() T%02li - failed to read frame \"%s\"\n", data->progName, data->worker_id, fname2);
-        return;
+void CloseSource(SOURCE* source, const char* progName) {
+    for(int track = 0; track < 2; track++) {
+        if(source->fptr[track] != stdin) fclose(source->fptr[track]);
     }
+    if(params.debug) fprintf(stderr, "%s() - Read %ld frame pairs from the streams\n", progName, source->nread);
+    pthread_mutex_destroy(&source->mutex);
+    pthread_cond_destroy(&source->cond);
+}
 
-    double starttime = GetRunTime();
-    int itable = 0;
-    for(int j = 0; j < params.outheight; j++) {
-        //y0 = j / (double)params.outheight;
-        //if (params.debug && j % (params.outheight/32) == 0)
-        //fprintf(stderr,"%s() - Scan line %d\n",progName,j);
-
-        for(int i = 0; i < params.outwidth; i++) {
-            //x0 = i / (double)params.outwidth;
-            COLOUR16 csum = { 0, 0, 0 }; // Supersampling antialising sum
-
-            // Antialiasing loops
-            for(size_t aj = 0; aj < params.antialias; aj++) {
-                //y = y0 + aj / dy; // 0 ... 1
-
-                // Antialiasing loops
-                for(size_t ai = 0; ai < params.antialias; ai++) {
-                    //x = x0 + ai / dx; // 0 ... 1
+/*
+   Start reading frame pairs into memory ahead of the decode stage, in the order the decoders claim them
+   With io_uring one thread keeps the reads of every free slot in flight, otherwise, or if a ring
+   can't be set up, a pool of reader threads each read one pair at a time
+*/
+boolean StartPrefetch(PREFETCH* prefetch,
+                      const char* progName,
+                      const char* template,
+                      const size_t* framelist,
+                      size_t nframes,
+                      int depth) {
+    void* (*reader)(void*) = PrefetchWorker;
 
-                    // Calculate latitude and longitude
-                    //longitude = x * TWOPI - M_PI;    // -pi ... pi
-                    //latitude = y * M_PI - M_PI/2;    // -pi/2 ... pi/2
-                    int face = g_lltable[itable].face;
-                    UV uv = g_lltable[itable].uv;
-                    itable++;
+    memset(prefetch, 0, sizeof(PREFETCH));
+    pthread_mutex_init(&prefetch->mutex, NULL);
+    pthread_cond_init(&prefetch->cond, NULL);
+    prefetch->depth = depth;
+    prefetch->endframe = nframes;
+    prefetch->framelist = framelist;
+    prefetch->template = template;
+    prefetch->nreaders = MIN(depth, PREFETCHREADERS);
+    if((prefetch->slots = calloc(depth, sizeof(PREFETCHSLOT))) == NULL
+       || (prefetch->readers = malloc(prefetch->nreaders * sizeof(pthread_t))) == NULL) {
+        fprintf(stderr, "StartPrefetch() - Failed to malloc %d prefetch slots\n", depth);
+        return (FALSE);
+    }
 
-                    // Sum over the supersampling set
-                    BITMAP4 c = GetColour(face, uv, data->frame_input1, data->frame_input2);
-                    csum.r += c.r;
-                    csum.g += c.g;
-                    csum.b += c.b;
-                }
-            }
+#ifdef HAVE_LIBURING
+    int status;
+    if((status = io_uring_queue_init(2 * depth, &prefetch->ring, 0)) == 0) {
+        prefetch->usering = TRUE;
+        prefetch->nreaders = 1;
+        reader = PrefetchRing;
+    } else if(params.debug) {
+        fprintf(stderr, "%s() - No io_uring (%s), prefetching with threads\n", progName, strerror(-status));
+    }
+#endif
 
-            // Finally update the spherical image
-            int index = j * params.outwidth + i;
-            data->frame_spherical[index].r = csum.r / params.antialias2;
-            data->frame_spherical[index].g = csum.g / params.antialias2;
-            data->frame_spherical[index].b = csum.b / params.antialias2;
+    for(int i = 0; i < prefetch->nreaders; i++) {
+        if(pthread_create(&prefetch->readers[i], NULL, reader, (void*)prefetch) != 0) {
+            fprintf(stderr, "StartPrefetch() - Failed to start prefetch thread %d\n", i);
+            return (FALSE);
         }
     }
-
     if(params.debug) {
         fprintf(stderr,
-                "%s() T%02li - Processing time: %g seconds\n",
-                data->progName,
-                data->worker_id,
-                GetRunTime() - starttime);
+                "%s() - Prefetching %d frame pairs ahead with %s\n",
+                progName,
+                depth,
+                prefetch->usering ? "io_uring" : "reader threads");
     }
 
-    // Write out the equirectangular
-    // Base the name on the name of the first frame
-    if(params.debug) fprintf(stderr, "%s() T%02li - Saving equirectangular\n", data->progName, data->worker_id);
-    WriteSpherical(fname1, nframe, data->frame_spherical, params.outwidth, params.outheight);
+    return (TRUE);
 }
 
-
 /*
-    Check the frames
-    - do they exist
-    - are they jpeg or png
-    - are they the same size
-    - determine which frame template we are using
+   Prefetch reader of the thread pool, the two files of a pair are read in turn
 */
-int CheckFrames(const char* fname1, const char* fname2, size_t* width, size_t* height) {
-    boolean frame1_is_jpg = IsJPEG(fname1);
-    boolean frame2_is_jpg = IsJPEG(fname2);
-    boolean frame1_is_png = IsPNG(fname1);
-    boolean frame2_is_png = IsPNG(fname2);
+void* PrefetchWorker(void* input) {
+    PREFETCH* prefetch = (PREFETCH*)input;
+    PREFETCHSLOT* slot;
+    char fname[2][256];
 
-    if((!frame1_is_jpg && !frame1_is_png) || (!frame2_is_jpg && !frame2_is_png)) {
-        fprintf(stderr, "CheckFrames() - frame name does not look like a jpeg or png file\n");
-        return (-1);
+    while((slot = ClaimPrefetch(prefetch, TRUE)) != NULL) {
+        size_t nframe = (prefetch->framelist != NULL) ? prefetch->framelist[slot->index] : params.n_start + slot->index;
+        set_frame_filename_from_template(fname[0], fname[1], nframe, prefetch->template);
+        for(int t = 0; t < 2; t++) {
+            slot->ok[t] = ReadWholeFile(fname[t], &slot->data[t], &slot->size[t], &slot->capacity[t]);
+        }
+        FinishPrefetch(prefetch, slot);
     }
 
-    if(params.debug) fprintf(stderr, "fname1=%s fname2=%s\n", fname1, fname2);
+    return NULL;
+}
 
-    FILE* fptr;
-    // Frame 1
-    if((fptr = fopen(fname1, "rb")) == NULL) {
-        fprintf(stderr, "CheckFrames() - Failed to open first frame \"%s\"\n", fname1);
-        return (-1);
-    }
-    int w1 = -1, h1 = -1, depth;
-    if(frame1_is_jpg) {
-        JPEG_Info(fptr, &w1, &h1, &depth);
-    } else {
-        PNG_Info(fptr, &w1, &h1, &depth);
-    }
-    fclose(fptr);
+/*
+   Claim the slot for the next frame pair to read, once its decoder has released the pair before
+   Return NULL when all have been claimed, or if not waiting when the slot isn't free yet
+*/
+PREFETCHSLOT* ClaimPrefetch(PREFETCH* prefetch, boolean wait) {
+    PREFETCHSLOT* slot = NULL;
 
-    // Frame 2
-    if((fptr = fopen(fname2, "rb")) == NULL) {
-        fprintf(stderr, "CheckFrames() - Failed to open second frame \"%s\"\n", fname2);
-        return (-1);
+    pthread_mutex_lock(&prefetch->mutex);
+    while(prefetch->nextread < prefetch->endframe) {
+        slot = &prefetch->slots[prefetch->nextread % prefetch->depth];
+        if(slot->state == PREFETCH_FREE) break;
+        slot = NULL;
+        if(!wait) break;
+        pthread_cond_wait(&prefetch->cond, &prefetch->mutex);
     }
-    int w2 = -1, h2 = -1;
-    if(frame2_is_jpg) {
-        JPEG_Info(fptr, &w2, &h2, &depth);
-    } else {
-        PNG_Info(fptr, &w2, &h2, &depth);
+    if(slot != NULL) {
+        slot->index = prefetch->nextread++;
+        slot->state = PREFETCH_READING;
     }
-    fclose(fptr);
+    pthread_mutex_unlock(&prefetch->mutex);
 
-    // Are they the same size
-    if(w1 != w2 || h1 != h2) {
-        fprintf(stderr, "CheckFrames() - Frame sizes don't match, %d != %d or %d != %d\n", w1, h1, w2, h2);
-        fprintf(stderr, "CheckFrames() - Frame sizes don't match, %d != %d or %d != %d\n", w1, w2, h1, h2);
-        return (-1);
-    }
+    return (slot);
+}
 
-    int template_n = -1;
-    // Is it a known template?
-    for(int i = 0; i < NTEMPLATE; i++) {
-        if(w1 == template[i].width && h1 == template[i].height) {
-            template_n = i;
-            break;
-        }
-    }
-    if(template_n < 0) {
-        fprintf(stderr, "CheckFrames() - No recognised frame template\n");
-        return (-1);
+void FinishPrefetch(PREFETCH* prefetch, PREFETCHSLOT* slot) {
+    pthread_mutex_lock(&prefetch->mutex);
+    slot->state = PREFETCH_READY;
+    prefetch->nread++;
+    for(int t = 0; t < 2; t++) prefetch->bytes += slot->ok[t] ? slot->size[t] : 0;
+    pthread_cond_broadcast(&prefetch->cond);
+    pthread_mutex_unlock(&prefetch->mutex);
+}
+
+/*
+   The frame pair of a claim index, waiting for it to be read if need be, it must be released after decoding
+*/
+PREFETCHSLOT* TakePrefetched(PREFETCH* prefetch, size_t index) {
+    PREFETCHSLOT* slot = &prefetch->slots[index % prefetch->depth];
+
+    pthread_mutex_lock(&prefetch->mutex);
+    if(slot->index != index || slot->state != PREFETCH_READY) {
+        double starttime = GetRunTime();
+        while(slot->index != index || slot->state != PREFETCH_READY) pthread_cond_wait(&prefetch->cond, &prefetch->mutex);
+        prefetch->nwaits++;
+        prefetch->waittime += GetRunTime() - starttime;
     }
+    pthread_mutex_unlock(&prefetch->mutex);
 
-    *width = w1;
-    *height = h1;
+    return (slot);
+}
 
-    return template_n;
+void ReleasePrefetched(PREFETCH* prefetch, PREFETCHSLOT* slot) {
+    pthread_mutex_lock(&prefetch->mutex);
+    slot->state = PREFETCH_FREE;
+    pthread_cond_broadcast(&prefetch->cond);
+    pthread_mutex_unlock(&prefetch->mutex);
 }
 
-// params.skip_existing
-void create_output_filename(char* fname, const char* basename, int nframe) {
-    if(strlen(params.outfilename) < 2) {
-        sprintf(fname, basename, 0, nframe);
-        for(int i = strlen(fname) - 1; i > 0; i--) {
-            if(fname[i] == '.') {
-                fname[i] = '\0';
-                break;
-            }
-        }
-        strcat(fname, "_sphere.png");
-    } else {
-        sprintf(fname, params.outfilename, nframe);
+/*
+   Once every frame pair has been claimed by the decoders the readers have finished
+*/
+void StopPrefetch(PREFETCH* prefetch, const char* progName) {
+    for(int i = 0; i < prefetch->nreaders; i++) pthread_join(prefetch->readers[i], NULL);
+#ifdef HAVE_LIBURING
+    if(prefetch->usering) io_uring_queue_exit(&prefetch->ring);
+#endif
+    if(params.debug) {
+        fprintf(stderr,
+                "%s() - Prefetched %ld frame pairs, %.1f MB, %d deep, decoders waited %ld times for %.3f s\n",
+                progName,
+                prefetch->nread,
+                prefetch->bytes / (1024 * 1024),
+                prefetch->depth,
+                prefetch->nwaits,
+                prefetch->waittime);
     }
+    for(int i = 0; i < prefetch->depth; i++) {
+        for(int t = 0; t < 2; t++) free(prefetch->slots[i].data[t]);
+    }
+    free(prefetch->slots);
+    free(prefetch->readers);
+    pthread_mutex_destroy(&prefetch->mutex);
+    pthread_cond_destroy(&prefetch->cond);
 }
 
-
 /*
-   Write spherical image
-    The file name is either using the mask params.outfilename which should have a %d for the frame number
-    or based upon the basename provided which will have two %d locations for track and framenumber
+   Read a whole file into a buffer that is grown as needed
 */
-int WriteSpherical(const char* basename, int nframe, const BITMAP4* img, int w, int h) {
-    // Create the output file name
-    char fname[256];
-    create_output_filename(fname, basename, nframe);
-
-    if(params.debug) fprintf(stderr, "WriteSpherical() - Saving file \"%s\"\n", fname);
+boolean ReadWholeFile(const char* fname, unsigned char** data, size_t* size, size_t* capacity) {
+    struct stat st;
+    ssize_t n;
+    int fd;
 
-    // Save
-    FILE* fptr;
-    if((fptr = fopen(fname, "wb")) == NULL) {
-        fprintf(stderr, "WriteSpherical() - Failed to open output file \"%s\"\n", fname);
+    *size = 0;
+    if((fd = open(fname, O_RDONLY)) < 0) return (FALSE);
+    if(fstat(fd, &st) != 0 || !GrowBuffer(data, capacity, st.st_size)) {
+        close(fd);
         return (FALSE);
     }
+    while(*size < (size_t)st.st_size && (n = read(fd, *data + *size, st.st_size - *size)) > 0) *size += n;
+    close(fd);
 
-    if(PNG_Write(fptr, img, w, h, FALSE)) {
-        fprintf(stderr, "WriteSpherical() - Failed to write output file \"%s\"\n", fname);
-    }
-    fclose(fptr);
+    return (*size == (size_t)st.st_size);
+}
 
+boolean GrowBuffer(unsigned char** data, size_t* capacity, size_t size) {
+    if(size <= *capacity && *data != NULL) return (TRUE);
+    free(*data);
+    if((*data = malloc(MAX(size, 1))) == NULL) {
+        *capacity = 0;
+        return (FALSE);
+    }
+    *capacity = size;
     return (TRUE);
 }
 
+#ifdef HAVE_LIBURING
 /*
-   Read a frame
+   Prefetch with io_uring, the reads of every claimed slot are in flight together
+   Files are opened here, their contents are read by the ring, a short read is continued from where it stopped
 */
-int ReadFrame(BITMAP4* img, char* fname, int w, int h) {
-    FILE* fptr;
+void* PrefetchRing(void* input) {
+    PREFETCH* prefetch = (PREFETCH*)input;
+    PREFETCHSLOT* slot;
+    struct io_uring_cqe* cqe;
+    int inflight = 0; // Slots being read
 
-    if(params.debug) fprintf(stderr, "ReadFrame() - Reading image \"%s\"\n", fname);
+    for(;;) {
+        // Only wait for a free slot when there is nothing to complete
+        while((slot = ClaimPrefetch(prefetch, inflight == 0)) != NULL) {
+            if(SubmitPrefetch(prefetch, slot)) inflight++;
+        }
+        if(inflight == 0) break;
 
-    // Attempt to open file
-    if((fptr = fopen(fname, "rb")) == NULL) {
-        fprintf(stderr, "ReadFrame() - Failed to open \"%s\"\n", fname);
-        return (FALSE);
+        io_uring_submit(&prefetch->ring);
+        if(io_uring_wait_cqe(&prefetch->ring, &cqe) != 0) continue;
+        unsigned long long id = io_uring_cqe_get_data64(cqe);
+        int res = cqe->res;
+        io_uring_cqe_seen(&prefetch->ring, cqe);
+
+        slot = &prefetch->slots[id / 2];
+        int t = id % 2;
+        if(res > 0) {
+            slot->done[t] += res;
+            if(slot->done[t] < slot->size[t]) {
+                QueueRead(prefetch, slot, t);
+                continue;
+            }
+            slot->ok[t] = TRUE;
+        }
+        close(slot->fd[t]);
+        if(--slot->pending == 0) {
+            FinishPrefetch(prefetch, slot);
+            inflight--;
+        }
     }
 
-    // Read image data
-    if((IsJPEG(fname) && JPEG_Read(fptr, img, &w, &h) != 0) || (IsPNG(fname) && PNG_Read(fptr, img, &w, &h) != 0)) {
-        fprintf(stderr, "ReadFrame() - Failed to correctly read JPG/PNG file \"%s\"\n", fname);
-        return (FALSE);
+    return NULL;
+}
+
+/*
+   Open the files of a claimed slot and queue their reads
+   Return FALSE if neither could be queued, the slot is then finished already
+*/
+boolean SubmitPrefetch(PREFETCH* prefetch, PREFETCHSLOT* slot) {
+    char fname[2][256];
+    struct stat st;
+    size_t nframe = (prefetch->framelist != NULL) ? prefetch->framelist[slot->index] : params.n_start + slot->index;
+
+    set_frame_filename_from_template(fname[0], fname[1], nframe, prefetch->template);
+    slot->pending = 0;
+    for(int t = 0; t < 2; t++) {
+        slot->ok[t] = FALSE;
+        slot->size[t] = 0;
+        slot->done[t] = 0;
+        if((slot->fd[t] = open(fname[t], O_RDONLY)) < 0) continue;
+        if(fstat(slot->fd[t], &st) != 0 || !GrowBuffer(&slot->data[t], &slot->capacity[t], st.st_size)) {
+            close(slot->fd[t]);
+            continue;
+        }
+        if((slot->size[t] = st.st_size) == 0) {
+            close(slot->fd[t]);
+            slot->ok[t] = TRUE;
+            continue;
+        }
+        QueueRead(prefetch, slot, t);
+        slot->pending++;
     }
-    fclose(fptr);
+    if(slot->pending == 0) FinishPrefetch(prefetch, slot);
 
-    return (TRUE);
+    return (slot->pending > 0);
+}
+
+void QueueRead(PREFETCH* prefetch, PREFETCHSLOT* slot, int t) {
+    struct io_uring_sqe* sqe;
+
+    while((sqe = io_uring_get_sqe(&prefetch->ring)) == NULL) io_uring_submit(&prefetch->ring);
+    io_uring_prep_read(sqe, slot->fd[t], slot->data[t] + slot->done[t], slot->size[t] - slot->done[t], slot->done[t]);
+    io_uring_sqe_set_data64(sqe, 2 * (slot - prefetch->slots) + t);
 }
+#endif
 
 /*
    Given longitude and latitude find corresponding face id and (u,v) coordinate on the face
@@ -562,17 +4178,16 @@ int FindFaceUV(double longitude, double latitude, UV* uv) {
 }
 
 /*
-    Given a face and a (u,v) in that face, determine colour from the two frames
+    Given a face and a (u,v) in that face, determine which frame and which pixels in that frame it maps to
     This is largely a mapping exercise from (u,v) of each face to the two frames
-    For faces left, right, down and top a blend is required between the two halves
+    For faces left, right, down and top a blend is required between the two halves,
+    in which case alpha is the position across the blend band, otherwise it is negative
     Relies on the values from the frame template
 */
-BITMAP4 GetColour(int face, UV uv, BITMAP4* frame1, BITMAP4* frame2) {
-    int ix, iy, index;
+void ResolveUV(int face, UV uv, SAMPLE* s) {
     int x0, w;
-    double alpha, duv;
+    double duv;
     UV uvleft, uvright;
-    BITMAP4 c = { 0, 0, 0, 255 }, c1, c2;
 
     // Rotate u,v counterclockwise by 90 degrees for lower frame
     if(face == DOWN || face == BACK || face == TOP) RotateUV90(&uv);
@@ -581,98 +4196,192 @@ BITMAP4 GetColour(int face, UV uv, BITMAP4* frame1, BITMAP4* frame2) {
     uvleft.v = uv.v;
     uvright.v = uv.v;
 
+    s->frame = (face == FRONT || face == LEFT || face == RIGHT) ? 1 : 2;
+    s->index2 = -1;
+    s->alpha = -1;
+    s->y = uv.v * template[whichtemplate].height;
+
     switch(face) {
     // Frame 1
     case FRONT:
     case BACK:
         x0 = template[whichtemplate].sidewidth;
         w = template[whichtemplate].centerwidth;
-        ix = x0 + uv.u * w;
-        iy = uv.v * template[whichtemplate].height;
-        index = iy * template[whichtemplate].width + ix;
-        c = (face == FRONT) ? frame1[index] : frame2[index];
+        s->x1 = x0 + uv.u * w;
         break;
     case LEFT:
     case DOWN:
-        w = template[whichtemplate].sidewidth;
-        duv = template[whichtemplate].blendwidth / (double)w;
-        uvleft.u = 2.0 * (0.5 - duv) * uv.u;
-        uvright.u = 2.0 * (0.5 - duv) * (uv.u - 0.5) + 0.5 + duv;
-        if(uvleft.u <= 0.5 - 2.0 * duv) {
-            ix = uvleft.u * w;
-            iy = uvleft.v * template[whichtemplate].height;
-            index = iy * template[whichtemplate].width + ix;
-            c = (face == LEFT) ? frame1[index] : frame2[index];
-        } else if(uvright.u >= 0.5 + 2.0 * duv) {
-            ix = uvright.u * w;
-            iy = uvright.v * template[whichtemplate].height;
-            index = iy * template[whichtemplate].width + ix;
-            c = (face == LEFT) ? frame1[index] : frame2[index];
-        } else {
-            ix = uvleft.u * w;
-            iy = uvleft.v * template[whichtemplate].height;
-            index = iy * template[whichtemplate].width + ix;
-            c1 = (face == LEFT) ? frame1[index] : frame2[index];
-            ix = uvright.u * w;
-            iy = uvright.v * template[whichtemplate].height;
-            index = iy * template[whichtemplate].width + ix;
-            c2 = (face == LEFT) ? frame1[index] : frame2[index];
-            alpha = (uvleft.u - 0.5 + 2.0 * duv) / (2.0 * duv);
-            c = ColourBlend(c1, c2, alpha);
-        }
-        break;
     case RIGHT:
     case TOP:
-        x0 = template[whichtemplate].sidewidth + template[whichtemplate].centerwidth;
+        x0 = (face == LEFT || face == DOWN) ? 0 : template[whichtemplate].sidewidth + template[whichtemplate].centerwidth;
         w = template[whichtemplate].sidewidth;
         duv = template[whichtemplate].blendwidth / (double)w;
         uvleft.u = 2.0 * (0.5 - duv) * uv.u;
         uvright.u = 2.0 * (0.5 - duv) * (uv.u - 0.5) + 0.5 + duv;
         if(uvleft.u <= 0.5 - 2.0 * duv) {
-            ix = x0 + uvleft.u * w;
-            iy = uv.v * template[whichtemplate].height;
-            index = iy * template[whichtemplate].width + ix;
-            c = (face == RIGHT) ? frame1[index] : frame2[index];
+            s->x1 = x0 + uvleft.u * w;
         } else if(uvright.u >= 0.5 + 2.0 * duv) {
-            ix = x0 + uvright.u * w;
-            iy = uvright.v * template[whichtemplate].height;
-            index = iy * template[whichtemplate].width + ix;
-            c = (face == RIGHT) ? frame1[index] : frame2[index];
+            s->x1 = x0 + uvright.u * w;
         } else {
-            ix = x0 + uvleft.u * w;
-            iy = uvleft.v * template[whichtemplate].height;
-            index = iy * template[whichtemplate].width + ix;
-            c1 = (face == RIGHT) ? frame1[index] : frame2[index];
-            ix = x0 + uvright.u * w;
-            iy = uvright.v * template[whichtemplate].height;
-            index = iy * template[whichtemplate].width + ix;
-            c2 = (face == RIGHT) ? frame1[index] : frame2[index];
-            alpha = (uvleft.u - 0.5 + 2.0 * duv) / (2.0 * duv);
-            c = ColourBlend(c1, c2, alpha);
+            s->x1 = x0 + uvleft.u * w;
+            s->x2 = x0 + uvright.u * w;
+            s->index2 = (int)s->y * template[whichtemplate].width + (int)s->x2;
+            s->alpha = (uvleft.u - 0.5 + 2.0 * duv) / (2.0 * duv);
         }
         break;
     }
+    s->index1 = (int)s->y * template[whichtemplate].width + (int)s->x1;
+}
 
-    return (c);
+/*
+    Given a face and a (u,v) in that face, determine colour from the two frames
+    with the sampling chosen, nearest pixel or bilinear
+*/
+BITMAP4 GetColour(int face, UV uv, BITMAP4* frame1, BITMAP4* frame2) {
+    if(params.sampling == SAMPLING_BILINEAR) return (GetColourBilinear(face, uv, frame1, frame2));
+
+    return (GetColourNearest(face, uv, frame1, frame2));
+}
+
+/*
+    Colour of the frame pixel the (u,v) lands in
+*/
+BITMAP4 GetColourNearest(int face, UV uv, BITMAP4* frame1, BITMAP4* frame2) {
+    SAMPLE s;
+    BITMAP4* frame;
+
+    ResolveUV(face, uv, &s);
+    frame = (s.frame == 1) ? frame1 : frame2;
+    if(s.alpha < 0) return (frame[s.index1]);
+
+    return (ColourBlend(frame[s.index1], frame[s.index2], BlendWeight(s.alpha)));
+}
+
+/*
+    Colour interpolated between the 4 frame pixels around the (u,v)
+    Each half of the seam blend is interpolated on its own
+*/
+BITMAP4 GetColourBilinear(int face, UV uv, BITMAP4* frame1, BITMAP4* frame2) {
+    SAMPLE s;
+    BITMAP4 *frame, c;
+
+    ResolveUV(face, uv, &s);
+    frame = (s.frame == 1) ? frame1 : frame2;
+    c = BilinearPixel(frame, face, s.x1, s.y);
+    if(s.alpha < 0) return (c);
+
+    return (ColourBlend(c, BilinearPixel(frame, face, s.x2, s.y), BlendWeight(s.alpha)));
+}
+
+/*
+    Bilinear interpolation at a continuous position in a frame, pixel centers are at +0.5
+*/
+BITMAP4 BilinearPixel(const BITMAP4* frame, int face, double x, double y) {
+    int wx, wy;
+    int index = BilinearIndex(face, x, y, &wx, &wy);
+
+    return (BilinearBlend(&frame[index], wx, wy));
 }
 
 /*
-    Blend two colours
+    The top left of the 2x2 frame pixels around a continuous position, and the weights of the right column
+    and the lower row, 0 ... 256. Only pixels of the same face region are used, so nothing bleeds in from
+    a neighbouring face or from the other half of a seam blend, the position is clamped to the region
+    and on its last column or row the 2x2 is moved back with all the weight on that column or row
 */
-BITMAP4 ColourBlend(BITMAP4 c1, BITMAP4 c2, double alpha) {
-    double m1;
+int BilinearIndex(int face, double x, double y, int* wx, int* wy) {
+    int xmin, xmax, fx, fy, ix, iy;
+    int height = template[whichtemplate].height;
+
+    // Columns of the face region, the side regions hold two halves
+    if(face == FRONT || face == BACK) {
+        xmin = template[whichtemplate].sidewidth;
+        xmax = xmin + template[whichtemplate].centerwidth - 1;
+    } else {
+        int half = template[whichtemplate].sidewidth / 2;
+        xmin = (face == LEFT || face == DOWN) ? 0 : template[whichtemplate].sidewidth + template[whichtemplate].centerwidth;
+        if(x >= xmin + half) xmin += half;
+        xmax = xmin + half - 1;
+    }
+
+    // Fixed point positions with 8 bit fractions
+    fx = MAX(256 * xmin, MIN((int)(x * 256) - 128, 256 * xmax));
+    fy = MAX(0, MIN((int)(y * 256) - 128, 256 * (height - 1)));
+    ix = fx >> 8;
+    iy = fy >> 8;
+    *wx = fx & 255;
+    *wy = fy & 255;
+    if(ix == xmax) {
+        ix--;
+        *wx = 256;
+    }
+    if(iy == height - 1) {
+        iy--;
+        *wy = 256;
+    }
+
+    return (iy * template[whichtemplate].width + ix);
+}
+
+/*
+    Interpolate the 2x2 pixels from p, the weights of the right column and the lower row are 0 ... 256
+    Same arithmetic as the bilinear gather kernels
+*/
+BITMAP4 BilinearBlend(const BITMAP4* p, int wx, int wy) {
+    int dy = template[whichtemplate].width;
     BITMAP4 c;
 
-    alpha = tanh(alpha * 5.0 - 5.0 / 2.0) / 2 + 0.5;
+    c.r = (((p[0].r * (256 - wx) + p[1].r * wx) * (256 - wy) + (p[dy].r * (256 - wx) + p[dy + 1].r * wx) * wy) >> 16);
+    c.g = (((p[0].g * (256 - wx) + p[1].g * wx) * (256 - wy) + (p[dy].g * (256 - wx) + p[dy + 1].g * wx) * wy) >> 16);
+    c.b = (((p[0].b * (256 - wx) + p[1].b * wx) * (256 - wy) + (p[dy].b * (256 - wx) + p[dy + 1].b * wx) * wy) >> 16);
+    c.a = p[0].a;
+
+    return (c);
+}
+
+/*
+    Blend two colours, weight of the second colour is 0 ... 256
+    Same arithmetic as the gather kernels
+*/
+BITMAP4 ColourBlend(BITMAP4 c1, BITMAP4 c2, int weight) {
+    int m1 = 256 - weight;
+    BITMAP4 c;
 
-    m1 = 1 - alpha;
-    c.r = m1 * c1.r + alpha * c2.r;
-    c.g = m1 * c1.g + alpha * c2.g;
-    c.b = m1 * c1.b + alpha * c2.b;
+    c.r = (m1 * c1.r + weight * c2.r) >> 8;
+    c.g = (m1 * c1.g + weight * c2.g) >> 8;
+    c.b = (m1 * c1.b + weight * c2.b) >> 8;
+    c.a = c1.a;
 
     return (c);
 }
 
+/*
+    Curve across the blend band, alpha 0 ... 1
+*/
+double BlendCurve(double alpha) {
+    switch(params.blendcurve) {
+    case BLEND_LINEAR: return (alpha);
+    case BLEND_SMOOTHSTEP: return (alpha * alpha * (3 - 2 * alpha));
+    default: return (tanh(alpha * 5.0 - 5.0 / 2.0) / 2 + 0.5);
+    }
+}
+
+/*
+    Tabulate the blend curve as integer weights, so blending needs no floating point per sample
+*/
+void InitBlend(void) {
+    for(int k = 0; k <= BLENDSTEPS; k++) g_blendweight[k] = lround(BlendCurve(k / (double)BLENDSTEPS) * 256);
+}
+
+/*
+    Weight of the second colour, 0 ... 256, for a position alpha 0 ... 1 across the blend band
+*/
+int BlendWeight(double alpha) {
+    int k = alpha * BLENDSTEPS + 0.5;
+
+    return (g_blendweight[MAX(0, MIN(k, BLENDSTEPS))]);
+}
+
 /*
     Rotate a uv by 90 degrees counterclockwise
 */
@@ -700,6 +4409,35 @@ void Init(void) {
     params.debug = FALSE;
     params.threads = MAX(1, sysconf(_SC_NPROCESSORS_ONLN));
     params.skip_existing = TRUE;
+    params.minsize = 0;
+    params.journal[0] = '\0';
+    params.tableformat = TABLE_GATHER;
+    params.validate = FALSE;
+    params.kernel = KERNEL_AUTO;
+    params.benchmark = 0;
+    params.blendcurve = BLEND_TANH;
+    params.sampling = SAMPLING_SUPERSAMPLE;
+    params.tilesize = 0;
+    params.framescale = 0;
+    params.outformat = -1;
+    params.quality = 90;
+    params.fullchroma = FALSE;
+    params.pnglevel = -1;
+    params.pngfilter = -1;
+    params.parallelpng = FALSE;
+    strcpy(params.framerate, "30:1");
+    params.window = 0;
+    params.decodethreads = 0;
+    params.encodethreads = 0;
+    params.informat = STREAM_NONE;
+    params.streamwidth = 0;
+    params.streamheight = 0;
+    params.prefetch = -1;
+    params.shard = 1;
+    params.nshards = 1;
+    params.chunk = 0;
+    params.leasedir[0] = '\0';
+    params.mergedir[0] = '\0';
 
     // Parameters for the 6 cube planes, ax + by + cz + d = 0
     params.faces[LEFT].a = -1;
@@ -790,7 +4528,38 @@ void GiveUsage(char* s) {
             "specified then it should contain one %%d field for the frame number\n");
     fprintf(stderr, "   -n n      Start index for the sequence,     default: %li\n", params.n_start);
     fprintf(stderr, "   -m n      End index for the sequence,       default: %li\n", params.n_stop);
-    fprintf(stderr, "   -t n      Amount of threads to use,         default: %li\n", params.threads);
+    fprintf(stderr, "   -t n      Amount of threads to remap with,  default: %li\n", params.threads);
+    fprintf(stderr, "   -D n      Threads reading the frames,       default: auto\n");
+    fprintf(stderr, "   -E n      Threads writing the output,       default: auto\n");
+    fprintf(stderr, "   -P n      Frame pairs read ahead into memory, 0 for none, default: twice -D\n");
+    fprintf(stderr, "   -l s      Lookup table format, uv, gather, folded or packed, default: gather\n");
+    fprintf(stderr, "   -V        Compare the lookup table against the uv table and exit\n");
+    fprintf(stderr, "   -s s      Sampling, supersample, nearest or bilinear, default: supersample\n");
+    fprintf(stderr, "   -b s      Seam blend curve, tanh, linear or smoothstep, default: tanh\n");
+    fprintf(stderr, "   -T n      Tile size for the table order and traversal, 0 for rows, default: 0\n");
+    fprintf(stderr, "   -r s      Decode jpeg frames at 1/n, auto, 1, 2, 4 or 8, default: auto\n");
+    fprintf(stderr, "   -e s      Output format, png, jpg, y4m or rgb, default: from the -o name, else png\n");
+    fprintf(stderr, "             y4m and rgb frames are streamed in order to the -o file or pipe, - for stdout\n");
+    fprintf(stderr, "   -q n      Jpeg output quality, 1 to 100,   default: %d\n", params.quality);
+    fprintf(stderr, "   -c s      Jpeg and y4m chroma subsampling, 420 or 444, default: 420\n");
+    fprintf(stderr, "   -R s      Frame rate of y4m output, n or num:den, default: 30\n");
+    fprintf(stderr, "   -W n      Frames in flight, buffered between the stages, default: auto\n");
+    fprintf(stderr, "   -z n      Png compression level, 0 to 9,   default: 6\n");
+    fprintf(stderr, "   -f s      Png row filter, none, sub, up, average, paeth or adaptive, default: adaptive\n");
+    fprintf(stderr, "   -p        Deflate png bands on all threads, default: off\n");
+    fprintf(stderr, "   -k s      Remap kernel, auto or scalar,     default: auto\n");
+    fprintf(stderr, "   -i s      Read frames from a stream per track, rgb, yuv420 or y4m, default: images\n");
+    fprintf(stderr, "             the streams are named by one %%d for the track, or as a pair name0,name5\n");
+    fprintf(stderr, "   -S WxH    Frame size of rgb and yuv420 streams\n");
+    fprintf(stderr, "   -B n      Time forming the first frame n times and exit\n");
     fprintf(stderr, "   -d        Enable debug mode,                default: off\n");
     fprintf(stderr, "   -F        Overwrite existing output images, default: off\n");
+    fprintf(stderr, "   -M n      Existing output images below n bytes are made again, default: 0\n");
+    fprintf(stderr, "   --shard k/N  Convert shard k of N of the frames found, 1 to N, default: 1/1\n");
+    fprintf(stderr, "   --chunk n    Frames given to a shard or lease together, 0 to deal them out, default: 0\n");
+    fprintf(stderr, "   --lease s    Claim chunks of frames with lock files in this shared directory, default: none\n");
+    fprintf(stderr, "   --merge s    Check the shard manifests in this directory cover every frame and exit\n");
+#ifdef JOURNALING_ENABLED
+    fprintf(stderr, "   -J s      Journal of the frames written, frames in it are skipped, default: none\n");
+#endif
 }
@@ -5,6 +5,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/time.h>
+#ifdef HAVE_LIBURING
+    #include <liburing.h> // Prefetch reads, set in the Makefile
+#endif
 
 #define LEFT 0
 #define RIGHT 1
@@ -15,6 +18,50 @@
 
 #define NEARLYONE 0.99999
 
+// Lookup table formats
+#define TABLE_UV 0 // Face and (u,v), colour determined per sample
+#define TABLE_GATHER 1 // Pre-resolved frame pixel indices and blend weights
+#define TABLE_FOLDED 2 // Face and (u,v) for one symmetric eighth of the sphere
+#define TABLE_PACKED 3 // Face and fixed point (u,v) in 32 bits
+#define NTABLEFORMAT 4
+
+// Seam blend curves
+#define BLEND_TANH 0
+#define BLEND_LINEAR 1
+#define BLEND_SMOOTHSTEP 2
+#define NBLENDCURVE 3
+
+// Sampling of the frames per output supersample
+#define SAMPLING_SUPERSAMPLE 0
+#define SAMPLING_NEAREST 1
+#define SAMPLING_BILINEAR 2
+#define NSAMPLING 3
+
+// Remap kernels
+#define KERNEL_AUTO 0 // Fastest the CPU supports
+#define KERNEL_SCALAR 1
+
+// Where the frames come from, jpeg or png images, or a stream per track
+#define STREAM_NONE 0
+#define STREAM_RGB 1 // Raw rgb24, top row first
+#define STREAM_YUV420 2 // Raw planar YUV 4:2:0
+#define STREAM_Y4M 3 // YUV4MPEG2 4:2:0, the size is in the header
+
+// What became of a frame of a shard, see WriteManifest()
+#define MANIFEST_EXISTS 0 // Done before this run
+#define MANIFEST_WRITTEN 1
+#define MANIFEST_FAILED 2
+#define NMANIFESTSTATUS 3
+
+// What becomes of a leased chunk when a frame of it leaves the pipeline, LeaseFrame()
+#define CHUNK_NONE 0 // Not leased
+#define CHUNK_LEFT 1 // Frames of it are left, its lock is touched
+#define CHUNK_DONE 2 // Marked finished
+#define CHUNK_FAILED 3 // Left unfinished for its lock to go stale
+
+#define LEASECHUNK 32 // Frames per leased chunk unless set by --chunk
+#define LEASETIME 600 // Seconds a lock may go untouched before another process takes its chunk over
+
 typedef struct {
     double x, y, z;
 } XYZ;
@@ -27,6 +74,13 @@ typedef struct {
     double a, b, c, d;
 } PLANE;
 
+typedef struct {
+    int frame; // 1 or 2
+    int index1, index2; // Pixel indices into the frame, index2 only for seam blends
+    double alpha; // Position across the blend band, negative if no blend
+    double x1, x2, y; // Continuous positions of the two pixels in the frame
+} SAMPLE;
+
 typedef struct {
     int outwidth, outheight;
     size_t framewidth, frameheight;
@@ -37,6 +91,32 @@ typedef struct {
     boolean debug;
     size_t threads;
     boolean skip_existing;
+    long minsize; // Existing outputs smaller than this are done again, 0 for any size
+    char journal[256]; // Frames written are recorded in it, empty for none
+    int tableformat;
+    boolean validate;
+    int kernel;
+    int benchmark; // Number of timed runs, 0 for normal processing
+    int blendcurve;
+    int sampling;
+    int tilesize; // Output tile size, 0 for rows
+    int framescale; // Jpeg frames are decoded at 1/framescale, 0 to choose
+    int outformat; // PNG or JPG, -1 to take it from the output name
+    int quality; // Jpeg output quality
+    boolean fullchroma; // Jpeg output 4:4:4 rather than 4:2:0
+    int pnglevel; // zlib level of png output, -1 for the default
+    int pngfilter; // Png row filter, -1 for adaptive
+    boolean parallelpng; // Png output deflated in bands shared between threads
+    char framerate[32]; // Of streamed output, num:den
+    int window; // Frames in flight, also those held to stream them in order, 0 to choose
+    int decodethreads, encodethreads; // Threads of the decode and encode stages, 0 to choose, -t is the remap stage
+    int informat; // STREAM_NONE for images, else the format of the streamed frames
+    int streamwidth, streamheight; // Of raw streamed frames
+    int prefetch; // Frame pairs read into memory ahead of the decode stage, 0 for none, -1 to choose
+    int shard, nshards; // This process does shard 1 ... nshards, 1 of 1 when not sharded
+    size_t chunk; // Consecutive frames assigned together to a shard or lease, 0 to assign frames in turn
+    char leasedir[256]; // Chunks are claimed by lock files in it, empty for a fixed shard
+    char mergedir[256]; // Check the manifests in it cover every frame and exit, empty to convert
 } PARAMS;
 
 typedef struct {
@@ -47,32 +127,340 @@ typedef struct {
     int equi_width;
 } FRAMESPECS;
 
+// A frame being formed or encoded, its bands of rows are shared out to any thread that is free
+typedef struct REMAPJOB {
+    BITMAP4 *frame1, *frame2;
+    BITMAP3* spherical;
+    int bandheight, nbands;
+    int nextband, ndone; // Bands claimed, bands finished
+    struct REMAPJOB* next;
+    boolean (*doband)(struct REMAPJOB*, int); // Does one band, RemapJobBand() or DeflateJobBand()
+    CODEC* codec; // Of the thread writing the frame, when encoding
+    boolean failed;
+} REMAPJOB;
+
+// The names of the files in a directory, a hash set with open addressing
+typedef struct {
+    char** names;
+    size_t capacity, count;
+} NAMESET;
+
+// The frames done already, the outputs listed from their directory, or the lines of the journal
+typedef struct {
+    NAMESET names;
+    boolean scanned; // The output directory was listed, else outputs are checked one by one
+    boolean journal; // The names are journal lines, "nframe outputname"
+    char dir[256];
+} DONESET;
+
+#ifdef JOURNALING_ENABLED
+// Frames written, appended to a file one "nframe outputname" line each, synced every JOURNALBATCH frames
+typedef struct {
+    pthread_mutex_t mutex;
+    FILE* fptr;
+    int pending; // Frames recorded since the last sync
+    long nrecorded;
+} JOURNAL;
+    #define JOURNALBATCH 32
+#endif
+
+// The frames given to a shard and what became of them, written out when it finishes
+typedef struct {
+    size_t nframe;
+    int status;
+} MANIFESTENTRY;
+typedef struct {
+    pthread_mutex_t mutex;
+    size_t* frames; // Of the shard or the chunks leased, including those done already
+    size_t nframes;
+    MANIFESTENTRY* entries; // Frames that went through the pipeline
+    size_t nentries;
+} MANIFEST;
+
+// Chunks of the frame list claimed across processes by creating chunk_n.lock in a shared directory
+// A chunk is finished once chunk_n.done exists, a lock not touched for LEASETIME seconds is taken over
+// The chunks are claimed under its mutex, the frames claimed are guarded by the mutex of the scheduler
+typedef struct LEASE {
+    pthread_mutex_t mutex;
+    const size_t* frames; // The whole list, the same in every process
+    size_t nframes;
+    size_t chunk, nchunks;
+    size_t start, ntried; // First chunk tried, then chunks tried in turn from it
+    size_t* claimed; // Frames of the chunks held, in claim order, the list of the scheduler
+    size_t* chunkof; // Chunk of each frame claimed
+    size_t* remaining; // Per chunk, frames held and not yet finished
+    boolean* held; // Per chunk, leased by this process
+    boolean* failed; // Per chunk, a frame of it was not written, it is left without chunk_n.done
+    const char* template;
+    MANIFEST* manifest;
+    DONESET done; // Read once, each chunk is checked against it
+    char host[64];
+    long nleased, ntakenover;
+} LEASE;
+
+// A frame in flight, taken from the pool by the decode stage and given back by the encode stage
+typedef struct {
+    size_t nframe;
+    size_t index; // Position in the sequence of frames claimed, the order of a stream
+    boolean ok; // Read and formed, else it is left out of the output
+    char fname[256]; // Of the track 0 frame, default output names are based on it
+    BITMAP4 *frame1, *frame2;
+    BITMAP3* spherical; // RGB, the output has no alpha
+} FRAMEBUFFER;
+
+// Bounded ring of frames passed between stages, guarded by the mutex of its owner
+typedef struct {
+    FRAMEBUFFER** items;
+    int capacity, head, count;
+} QUEUE;
+
+// Shared by all the threads, hands out frame numbers to the decode stage, decoded frames to the remap stage
+// and then the bands of frames in progress
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond; // Signalled when a frame is added, finished or no frames are left
+    size_t nextframe; // Index of the next frame to claim
+    size_t endframe; // Number of frames, cut short when streamed frames run out
+    size_t* framelist; // Frame numbers found by FindFrames(), NULL when numbered on from -n
+    int nactive; // Frames claimed and not yet written
+    REMAPJOB* jobs; // Frames with bands not yet claimed, oldest first
+    QUEUE decoded; // Frames read, waiting for the remap stage
+    int ndecoders; // Decode threads still claiming frames
+    struct LEASE* lease; // Chunks claimed from other processes, the list grows as they are, NULL for a fixed list
+} SCHEDULER;
+
+// The buffers of the frames in flight, and the queue from the remap to the encode stage
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond; // Signalled when a buffer is given back, a frame is formed or the remap stage ends
+    FRAMEBUFFER* buffers;
+    int nbuffers;
+    QUEUE pool; // Buffers free for the decode stage
+    QUEUE formed; // Frames formed, waiting for the encode stage
+    int nremappers; // Remap threads still running
+} PIPELINE;
+
+// A frame waiting in the reorder buffer of a stream
+typedef struct {
+    size_t nframe;
+    boolean ready; // Converted and waiting to be written
+    boolean missing; // Couldn't be formed, nothing is written for it
+    unsigned char* data;
+} SINKSLOT;
+
+// Frames streamed in frame order to one file, pipe or stdout, as y4m or raw RGB
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond; // Signalled when a frame has been written
+    FILE* fptr;
+    size_t next; // Next frame to write
+    int window; // Frames that may be held waiting for the frames before them
+    boolean writing; // A thread is writing out the frames that are ready
+    boolean failed;
+    size_t framesize;
+    SINKSLOT* slots;
+    long nwritten, nmissing;
+} SINK;
+
+// Frame pairs streamed in, one file, pipe or descriptor per track, read in frame order
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond; // Signalled when a frame pair has been read
+    FILE* fptr[2]; // Track 0 and track 5
+    int format;
+    boolean fullrange; // YUV is 0 to 255 rather than 16 to 235
+    int width, height;
+    size_t framesize; // Of one frame of one track, without the y4m FRAME line
+    size_t next; // Next frame to read
+    boolean ended;
+    long nread;
+} SOURCE;
+
+// A frame pair read into memory ahead of the decode stage, for the claim index of the frame
+#define PREFETCH_FREE 0
+#define PREFETCH_READING 1
+#define PREFETCH_READY 2
+typedef struct {
+    size_t index;
+    int state;
+    unsigned char* data[2]; // Whole image files of track 0 and track 5
+    size_t size[2], capacity[2];
+    boolean ok[2]; // Read in full
+#ifdef HAVE_LIBURING
+    int fd[2];
+    size_t done[2]; // Bytes read so far
+    int pending; // Files with a read in flight
+#endif
+} PREFETCHSLOT;
+
+// Frame files read ahead, by io_uring when built with HAVE_LIBURING, otherwise by a pool of reader threads
+// Frame index k is held in slot k % depth, that slot is read again once the decoder releases it
+#define PREFETCHREADERS 8 // Most reader threads of the pool
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond; // Signalled when a slot is read or released
+    PREFETCHSLOT* slots;
+    int depth;
+    size_t nextread; // Claim index of the next frame pair to read
+    size_t endframe;
+    const size_t* framelist; // As the scheduler
+    const char* template;
+    pthread_t* readers;
+    int nreaders;
+    boolean usering;
+#ifdef HAVE_LIBURING
+    struct io_uring ring;
+#endif
+    long nread, nwaits; // Frame pairs read, times a decoder had to wait for one
+    double bytes, waittime;
+} PREFETCH;
+
 typedef struct {
     size_t worker_id;
-    pthread_mutex_t* counter_mutex;
-    size_t* ip_shared_counter;
+    SCHEDULER* scheduler;
+    SINK* sink; // Stream the frames go to, NULL when written as images
+    SOURCE* source; // Streams the frames come from, NULL when read as images
+    PREFETCH* prefetch; // Frame files read ahead, NULL when each is read as it is decoded
+    MANIFEST* manifest; // NULL when not sharded
+    PIPELINE* pipeline; // NULL for threads that only help with bands
+#ifdef JOURNALING_ENABLED
+    JOURNAL* journal; // NULL when not kept
+#endif
+    unsigned char* frame_raw; // A frame pair as read from the streams, decode stage
     const char* progName;
     const char* last_argument;
 
-    BITMAP4* frame_input1;
-    BITMAP4* frame_input2;
-    BITMAP4* frame_spherical;
+    CODEC* codec; // Decoder or encoder state kept from frame to frame
 } THREAD_DATA;
 
 
 // Prototypes
 void* worker_function(void* input);
+void* DecodeWorker(void*);
+void* EncodeWorker(void*);
 void set_frame_filename_from_template(char*, char*, int, const char*);
-void process_single_image(THREAD_DATA*, int);
-int CheckFrames(const char*, const char*, size_t*, size_t*);
+boolean DecodeFrame(THREAD_DATA*, FRAMEBUFFER*);
+void EndFrame(SCHEDULER*, size_t, boolean);
+boolean InitQueue(QUEUE*, int);
+void PutQueue(QUEUE*, FRAMEBUFFER*);
+FRAMEBUFFER* TakeQueue(QUEUE*);
+void DestroyQueue(QUEUE*);
+boolean OpenPipeline(PIPELINE*, const char*, int);
+void ClosePipeline(PIPELINE*);
+FRAMEBUFFER* TakeBuffer(PIPELINE*);
+void GiveBuffer(PIPELINE*, FRAMEBUFFER*);
+void PassFormed(PIPELINE*, FRAMEBUFFER*);
+FRAMEBUFFER* TakeFormed(PIPELINE*);
+int CheckFrames(const char*, const char*, size_t*, size_t*, boolean*);
 void create_output_filename(char*, const char*, int);
-int WriteSpherical(const char*, int, const BITMAP4*, int, int);
-int ReadFrame(BITMAP4*, char*, int, int);
+int WriteSpherical(SCHEDULER*, CODEC*, const char*, int, const BITMAP3*, int, int);
+boolean OpenSink(SINK*, const char*, size_t, size_t);
+boolean SinkFrame(SINK*, size_t, const BITMAP3*);
+void CloseSink(SINK*, const char*);
+void StreamFrame(unsigned char*, const BITMAP3*);
+void RGBToYUV444Span(const BITMAP3*, unsigned char*, unsigned char*, unsigned char*, int);
+void RGBToYUV420Span(const BITMAP3*, const BITMAP3*, unsigned char*, unsigned char*, unsigned char*, unsigned char*, int);
+void RGBToYUV444AVX2Span(const BITMAP3*, unsigned char*, unsigned char*, unsigned char*, int);
+void RGBToYUV420AVX2Span(const BITMAP3*, const BITMAP3*, unsigned char*, unsigned char*, unsigned char*, unsigned char*, int);
+int ProbeFrame(const char*, IMAGEINFO*);
+void ScaleFrames(const char*, boolean);
+int ReadFrame(CODEC*, BITMAP4*, char*, int, int);
+int ReadFrameMem(CODEC*, BITMAP4*, const unsigned char*, size_t, const char*, int, int);
+boolean StartPrefetch(PREFETCH*, const char*, const char*, const size_t*, size_t, int);
+void* PrefetchWorker(void*);
+PREFETCHSLOT* ClaimPrefetch(PREFETCH*, boolean);
+void FinishPrefetch(PREFETCH*, PREFETCHSLOT*);
+PREFETCHSLOT* TakePrefetched(PREFETCH*, size_t);
+void ReleasePrefetched(PREFETCH*, PREFETCHSLOT*);
+void StopPrefetch(PREFETCH*, const char*);
+boolean ReadWholeFile(const char*, unsigned char**, size_t*, size_t*);
+boolean GrowBuffer(unsigned char**, size_t*, size_t);
+#ifdef HAVE_LIBURING
+void* PrefetchRing(void*);
+boolean SubmitPrefetch(PREFETCH*, PREFETCHSLOT*);
+void QueueRead(PREFETCH*, PREFETCHSLOT*, int);
+#endif
+boolean OpenSource(SOURCE*, const char*, const char*);
+boolean ReadY4MHeader(FILE*, const char*, int*, int*, boolean*);
+boolean ReadSourceFrames(SOURCE*, size_t, unsigned char*);
+void SourceToFrame(const SOURCE*, const unsigned char*, BITMAP4*);
+void CloseSource(SOURCE*, const char*);
 int FindFaceUV(double, double, UV*);
+boolean MakeLookupTable(const char*);
+boolean ValidateTable(const char*);
 BITMAP4 GetColour(int, UV, BITMAP4*, BITMAP4*);
+void ResolveUV(int, UV, SAMPLE*);
+void RemapUVSpan(BITMAP4*, BITMAP4*, BITMAP3*, int, int, int);
+void RemapFolded(BITMAP4*, BITMAP4*, BITMAP3*, int, int);
+void RemapPackedSpan(BITMAP4*, BITMAP4*, BITMAP3*, int, int, int);
+void RemapGatherSpan(const BITMAP4*, const BITMAP4*, BITMAP3*, int, int, int);
+void RemapGatherAVX2Span(const BITMAP4*, const BITMAP4*, BITMAP3*, int, int, int);
+void RemapBilinearSpan(const BITMAP4*, const BITMAP4*, BITMAP3*, int, int, int);
+void RemapBilinearAVX2Span(const BITMAP4*, const BITMAP4*, BITMAP3*, int, int, int);
+void SelectRemapKernel(const char*);
+void RemapFrame(BITMAP4*, BITMAP4*, BITMAP3*, int, int);
+void InitScheduler(SCHEDULER*, size_t*, size_t);
+size_t* FindFrames(const char*, const char*, size_t*);
+void LoadDone(DONESET*, const char*, const char*, size_t);
+size_t FilterDone(const DONESET*, const char*, const char*, size_t*, size_t);
+size_t DropDone(const char*, const char*, size_t*, size_t);
+void OutputDirectory(const char*, size_t, char*, size_t);
+boolean OutputExists(const NAMESET*, boolean, const char*, const char*);
+size_t SelectShard(size_t*, size_t);
+boolean InitManifest(MANIFEST*, const size_t*, size_t, size_t);
+void AddManifestFrames(MANIFEST*, const size_t*, size_t);
+void RecordManifest(MANIFEST*, size_t, int);
+boolean WriteManifest(MANIFEST*, const char*, const char*, const char*, const char*);
+void FreeManifest(MANIFEST*);
+int CompareEntries(const void*, const void*);
+boolean MergeManifests(const char*, const char*, const size_t*, size_t);
+boolean InitLease(LEASE*, const char*, const char*, const size_t*, size_t, MANIFEST*);
+void LeaseChunk(SCHEDULER*, const char*);
+long ClaimChunk(LEASE*);
+boolean TakeLease(LEASE*, size_t, boolean);
+void LeaseNames(size_t, char*, char*);
+int LeaseFrame(LEASE*, size_t, boolean, size_t*);
+void TouchChunk(size_t);
+void FinishChunk(size_t);
+void FreeLease(LEASE*, const char*);
+#ifdef JOURNALING_ENABLED
+void ReadJournal(NAMESET*, const char*);
+boolean OpenJournal(JOURNAL*, const char*);
+void JournalFrame(JOURNAL*, size_t, const char*);
+void CloseJournal(JOURNAL*, const char*);
+#endif
+boolean ScanNames(NAMESET*, const char*);
+boolean AddName(NAMESET*, const char*);
+boolean HasName(const NAMESET*, const char*);
+void FreeNames(NAMESET*);
+size_t HashName(const char*);
+boolean TrackTemplate(const char*, int, char*, char*);
+boolean MatchFrame(const char*, const char*, size_t*);
+size_t* ScanTrack(const char*, const char*, size_t*);
+void ReportFrames(const char*, const char*, const size_t*, size_t);
+int CompareFrames(const void*, const void*);
+void DestroyScheduler(SCHEDULER*);
+void RemapShared(SCHEDULER*, BITMAP4*, BITMAP4*, BITMAP3*);
+void RemapBand(SCHEDULER*, REMAPJOB*);
+void ShareBands(SCHEDULER*, REMAPJOB*);
+boolean RemapJobBand(REMAPJOB*, int);
+boolean DeflateJobBand(REMAPJOB*, int);
+boolean EncodeShared(SCHEDULER*, CODEC*, const BITMAP3*, FILE*);
+void ReferenceRows(void*, int, int);
+double ImagePSNR(const BITMAP3*, const BITMAP3*, long);
+double TimeRemapShared(const char*, BITMAP4*, BITMAP4*, BITMAP3*, size_t*);
+boolean Benchmark(const char*, const char*, size_t);
 int CheckTemplate(char*, int);
 
-BITMAP4 ColourBlend(BITMAP4, BITMAP4, double);
+BITMAP4 GetColourNearest(int, UV, BITMAP4*, BITMAP4*);
+BITMAP4 GetColourBilinear(int, UV, BITMAP4*, BITMAP4*);
+BITMAP4 BilinearPixel(const BITMAP4*, int, double, double);
+int BilinearIndex(int, double, double, int*, int*);
+BITMAP4 BilinearBlend(const BITMAP4*, int, int);
+BITMAP4 ColourBlend(BITMAP4, BITMAP4, int);
+double BlendCurve(double);
+void InitBlend(void);
+int BlendWeight(double);
 void RotateUV90(UV*);
 void Init(void);
 double GetRunTime(void);